@@ -0,0 +1,303 @@
+/*
+ * Generates the standard bench corpus and the key scripts replayed on it.
+ *
+ * ./bench/corpus dir
+ *
+ * Files:
+ *
+ * -   server.log: 64MB of server log lines
+ * -   min.json: 16MB of minified JSON on a single line
+ * -   cjk.txt: 16MB of CJK text, 3 bytes per character
+ * -   source.c: 1M lines of C
+ *
+ * Key scripts (raw bytes, as typed in the editor):
+ *
+ * -   scroll.keys: paging through the file and back
+ * -   edit.keys: typing, backspacing and undoing in the middle of the file
+ * -   search.keys: incremental literal and regex search, then repeats
+ * -   page.keys: paging only, every frame is a new screen
+ * -   region.keys: growing and shrinking a selection
+ * -   goto.keys: jumping to lines, percentages and byte offsets
+ * -   batch.script: a --batch script, the same edits as batch.sed
+ * -   multi.keys: typing at a cursor on each of about 10000 lines
+ * -   block.keys: jumping between matching brackets and over blocks
+ *
+ * The output only depends on the seed, so runs are comparable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+
+static uint32_t rng(uint32_t n)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 32) % n;
+}
+
+static FILE *open_out(const char *dir, const char *name)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    return fp;
+}
+
+static const char *pick(const char **words, size_t n)
+{
+    return words[rng(n)];
+}
+
+#define PICK(words) pick(words, sizeof(words) / sizeof(words[0]))
+
+// #########################################################################
+// Files
+// #########################################################################
+
+static void gen_log(const char *dir)
+{
+    static const char *levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN",
+                                    "ERROR" };
+    static const char *services[] = { "api", "auth", "billing", "search",
+                                      "worker", "gateway" };
+    static const char *paths[] = { "/v1/users", "/v1/orders", "/v1/search",
+                                   "/health", "/v2/invoices", "/login" };
+
+    FILE *fp = open_out(dir, "server.log");
+    long size = 0;
+
+    for (uint32_t i = 0; size < 64L * 1024 * 1024; ++i) {
+        size += fprintf(fp,
+                        "2025-06-%02u %02u:%02u:%02u.%03u %-5s %s[%u]: "
+                        "request id=%08x path=%s status=%u took=%ums\n",
+                        1 + i / 2000000 % 30, i / 100000 % 24, i / 1000 % 60,
+                        i / 10 % 60, rng(1000), PICK(levels), PICK(services),
+                        1000 + rng(50), rng(0xffffffff), PICK(paths),
+                        rng(10) ? 200 : 500, rng(2000));
+    }
+
+    fclose(fp);
+}
+
+static void gen_json(const char *dir)
+{
+    static const char *names[] = { "alpha", "beta", "gamma", "delta",
+                                   "epsilon", "zeta", "eta", "theta" };
+    static const char *tags[] = { "\"new\"", "\"sale\"", "\"used\"",
+                                  "\"rare\"", "\"bulk\"" };
+
+    FILE *fp = open_out(dir, "min.json");
+    long size = fprintf(fp, "[");
+
+    for (uint32_t i = 0; size < 16L * 1024 * 1024; ++i) {
+        size += fprintf(fp,
+                        "%s{\"id\":%u,\"name\":\"%s-%u\",\"price\":%u.%02u,"
+                        "\"tags\":[%s,%s],\"stock\":{\"count\":%u,"
+                        "\"warehouse\":\"%s\"},\"active\":%s}",
+                        i ? "," : "", i, PICK(names), rng(10000), rng(1000),
+                        rng(100), PICK(tags), PICK(tags), rng(500),
+                        PICK(names), rng(2) ? "true" : "false");
+    }
+
+    fprintf(fp, "]");
+    fclose(fp);
+}
+
+static void gen_cjk(const char *dir)
+{
+    FILE *fp = open_out(dir, "cjk.txt");
+    long size = 0;
+
+    while (size < 16L * 1024 * 1024) {
+        uint32_t length = 20 + rng(40);
+
+        for (uint32_t i = 0; i < length; ++i) {
+            uint32_t cp = i + 1 == length ? 0x3002 : 0x4e00 + rng(0x5200);
+            fputc(0xe0 | (cp >> 12), fp);
+            fputc(0x80 | ((cp >> 6) & 0x3f), fp);
+            fputc(0x80 | (cp & 0x3f), fp);
+        }
+        fputc('\n', fp);
+        size += length * 3 + 1;
+    }
+
+    fclose(fp);
+}
+
+static void gen_source(const char *dir)
+{
+    static const char *types[] = { "u32", "u64", "bool", "char *", "Buffer *",
+                                   "const SB *" };
+    static const char *names[] = { "offset", "size", "cursor", "line", "count",
+                                   "begin", "end", "data" };
+
+    FILE *fp = open_out(dir, "source.c");
+    uint32_t lines = 0;
+
+    fprintf(fp, "#include <stdio.h>\n#include \"ted.h\"\n\n");
+    lines += 3;
+
+    for (uint32_t f = 0; lines < 1000000; ++f) {
+        uint32_t body = 4 + rng(20);
+
+        fprintf(fp, "// Handles case %u of the %s table.\n", f, PICK(names));
+        fprintf(fp, "static %s fn_%u(%s%s, u32 n)\n{\n",
+                PICK(types), f, PICK(types), PICK(names));
+        lines += 3;
+
+        for (uint32_t i = 0; i < body; ++i) {
+            switch (rng(4)) {
+            case 0:
+                fprintf(fp, "    u32 %s_%u = n * %u + %u;\n",
+                        PICK(names), i, rng(64), rng(1000));
+                break;
+            case 1:
+                fprintf(fp, "    if (n > %u) return fn_%u(NULL, n - 1);\n",
+                        rng(100), rng(f + 1));
+                break;
+            case 2:
+                fprintf(fp, "    printf(\"%s: %%u\\n\", n); /* %s */\n",
+                        PICK(names), PICK(names));
+                break;
+            default:
+                fprintf(fp, "    for (u32 i = 0; i < n; ++i) n ^= i << %u;\n",
+                        rng(8));
+            }
+            lines += 1;
+        }
+
+        fprintf(fp, "    return 0;\n}\n\n");
+        lines += 3;
+    }
+
+    fclose(fp);
+}
+
+// #########################################################################
+// Key scripts
+// #########################################################################
+
+static void repeat(FILE *fp, const char *keys, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; ++i) fputs(keys, fp);
+}
+
+static void gen_keys(const char *dir)
+{
+    FILE *fp = open_out(dir, "scroll.keys");
+    repeat(fp, "n", 300);
+    repeat(fp, "j", 500);
+    repeat(fp, "p", 300);
+    repeat(fp, "G", 1);
+    repeat(fp, "k", 500);
+    repeat(fp, "g", 1);
+    repeat(fp, "$0", 100);
+    fputc('q', fp);
+    fclose(fp);
+
+    fp = open_out(dir, "edit.keys");
+    repeat(fp, "n", 200);
+    repeat(fp, "f", 1);
+    fputc('o', fp);
+    for (uint32_t i = 0; i < 20; ++i) {
+        fputs("hello, world", fp);
+        repeat(fp, "\x7f", 5);
+        fputc(i % 4 ? ' ' : '\n', fp);
+    }
+    fputc('\033', fp);
+    repeat(fp, "u", 20);
+    repeat(fp, "U", 20);
+    fputc('q', fp);
+    fclose(fp);
+
+    fp = open_out(dir, "page.keys");
+    repeat(fp, "n", 300);
+    repeat(fp, "p", 300);
+    fputc('q', fp);
+    fclose(fp);
+
+    fp = open_out(dir, "region.keys");
+    repeat(fp, "n", 50);
+    fputc('v', fp);
+    repeat(fp, "j", 100);
+    repeat(fp, "k", 50);
+    repeat(fp, "$", 1);
+    fputc('v', fp);
+    fputc('q', fp);
+    fclose(fp);
+
+    fp = open_out(dir, "goto.keys");
+    for (uint32_t i = 1; i <= 20; ++i) {
+        fprintf(fp, ":%u\r:%u%%\r:%ub\r", i * 50000, i * 5, i * 1000000);
+    }
+    fputs("G:1\r", fp);
+    fputc('q', fp);
+    fclose(fp);
+
+    fp = open_out(dir, "multi.keys");
+    repeat(fp, "n", 100);
+    fputc('v', fp);
+    repeat(fp, "n", 450);
+    fputc('m', fp);
+    repeat(fp, "hello, world", 2);
+    repeat(fp, "\x7f", 5);
+    fputc('\033', fp);
+    fputc('u', fp);
+    fputc('q', fp);
+    fclose(fp);
+
+    fp = open_out(dir, "block.keys");
+    repeat(fp, "n", 50);
+    repeat(fp, "}", 300);
+    repeat(fp, "%", 100);
+    repeat(fp, "{", 300);
+    fputs("g%", fp);
+    fputc('q', fp);
+    fclose(fp);
+
+    fp = open_out(dir, "batch.script");
+    fputs("r/u32 /uint32_t /\n", fp);
+    fputs("s/\\/\\* [a-z]+ \\*\\///\n", fp);
+    fclose(fp);
+
+    fp = open_out(dir, "batch.sed");
+    fputs("s/u32 /uint32_t /g\n", fp);
+    fputs("s/\\/\\* [a-z][a-z]* \\*\\///g\n", fp);
+    fclose(fp);
+
+    fp = open_out(dir, "search.keys");
+    fputs("/id=\r", fp);
+    repeat(fp, "]", 50);
+    fputs("/\x12" "s[a-z]+[0-9]\r", fp);
+    repeat(fp, "]", 50);
+    repeat(fp, "[", 50);
+    fputs("?zzzz\033", fp);
+    fputc('q', fp);
+    fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        printf("usage: corpus dir\n");
+        return 1;
+    }
+
+    gen_log(argv[1]);
+    gen_json(argv[1]);
+    gen_cjk(argv[1]);
+    gen_source(argv[1]);
+    gen_keys(argv[1]);
+
+    return 0;
+}
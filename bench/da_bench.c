@@ -0,0 +1,220 @@
+/*
+ * Microbenchmarks for da.h under the access patterns of the editor.
+ *
+ * ./build.sh bench (runs it after the editor benchmarks)
+ *
+ * The policy macros can be overridden to compare settings, for example:
+ *
+ * BENCH_CFLAGS='-DDA_SHRINK_DIV=4 -DDA_SHRINK_MUL=2' ./build.sh bench
+ * BENCH_CFLAGS='-DDA_USE_MREMAP' ./build.sh bench
+ *
+ * Every array goes through a counting allocator, so besides the time per
+ * operation the table shows how often the allocator was called and how many
+ * bytes it had to move.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../da.h"
+
+DA_TYPEDEF(char, SB)
+DA_TYPEDEF(uint32_t, U32s)
+
+typedef struct Counter {
+    DA_Allocator alloc;
+    size_t calls;
+    size_t bytes_moved; // upper bound: old size of every resized block
+} Counter;
+
+static void *counting_resize(void   *ctx,
+                             void   *ptr,
+                             size_t  old_size,
+                             size_t  new_size)
+{
+    Counter *c = ctx;
+    c->calls += 1;
+    if (ptr && new_size) c->bytes_moved += old_size;
+    return da_resize(NULL, ptr, old_size, new_size);
+}
+
+static void counter_init(Counter *c)
+{
+    memset(c, 0, sizeof(Counter));
+    c->alloc.resize = counting_resize;
+    c->alloc.ctx = c;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, size_t ops, double ns, const Counter *c)
+{
+    printf("%-22s %10zu %10.2f %10zu %12.1f\n",
+           name, ops, ns / ops, c->calls, c->bytes_moved / (1024.0 * 1024.0));
+}
+
+// #########################################################################
+// Patterns
+// #########################################################################
+
+// Typing and backspacing in the middle of a 1MB file.
+static void bench_type_backspace(void)
+{
+    Counter c;
+    counter_init(&c);
+
+    SB text = SB_create_with(&c.alloc);
+    for (size_t i = 0; i < 1024 * 1024; ++i) SB_push_back(&text, 'a' + i % 26);
+
+    size_t ops = 200000;
+    size_t pos = text.size / 2;
+    double t = now_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        char ch = 'x';
+        SB_push_many(&text, pos, &ch, 1);
+        SB_delete_many(&text, pos, 1);
+    }
+    report("type/backspace 1MB", ops, now_ns() - t, &c);
+
+    SB_destroy(&text);
+}
+
+// Typing and backspacing right at the growth boundary.
+static void bench_boundary(void)
+{
+    Counter c;
+    counter_init(&c);
+
+    SB text = SB_create_with(&c.alloc);
+    while (text.size < text.cap || text.cap < 65536) SB_push_back(&text, 'a');
+
+    size_t ops = 1000000;
+    double t = now_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        SB_push_back(&text, 'x');
+        SB_pop_back(&text);
+    }
+    report("push/pop at boundary", ops, now_ns() - t, &c);
+
+    SB_destroy(&text);
+}
+
+// Pasting a block twice the size of the text and undoing it.
+static void bench_paste_undo(void)
+{
+    Counter c;
+    counter_init(&c);
+
+    SB text = SB_create_with(&c.alloc);
+    SB block = SB_create();
+    for (size_t i = 0; i < 64 * 1024; ++i) SB_push_back(&text, 'a');
+    for (size_t i = 0; i < 128 * 1024; ++i) SB_push_back(&block, 'b');
+
+    size_t ops = 2000;
+    double t = now_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        SB_push_many(&text, 0, block.data, block.size);
+        SB_delete_many(&text, 0, block.size);
+    }
+    report("paste/undo 128K", ops, now_ns() - t, &c);
+
+    SB_destroy(&block);
+    SB_destroy(&text);
+}
+
+// Yanking short pieces of text into the clipboard.
+static void bench_clipboard(void)
+{
+    Counter c;
+    counter_init(&c);
+
+    SB clipboard = SB_create_with(&c.alloc);
+    char line[80];
+    memset(line, 'c', sizeof(line));
+
+    size_t ops = 1000000;
+    double t = now_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        SB_clear(&clipboard);
+        SB_push_back_many(&clipboard, line, sizeof(line));
+    }
+    report("clipboard clear/yank", ops, now_ns() - t, &c);
+
+    SB_destroy(&clipboard);
+}
+
+// Rebuilding the line index of a 100k line file after every edit.
+static void bench_line_index(void)
+{
+    Counter c;
+    counter_init(&c);
+
+    U32s lines = U32s_create_with(&c.alloc);
+
+    size_t ops = 200;
+    double t = now_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        lines.size = 0;
+        for (uint32_t j = 0; j < 100000; ++j) U32s_push_back(&lines, j * 40);
+        U32s_shrink_to_fit(&lines);
+    }
+    report("line index rebuild", ops, now_ns() - t, &c);
+
+    U32s_destroy(&lines);
+}
+
+// Reading a 512MB file in 1MB chunks.
+static void bench_large_append(void)
+{
+    Counter c;
+    counter_init(&c);
+
+    SB text = SB_create_with(&c.alloc);
+    SB chunk = SB_create();
+    SB_reserve_cap(&chunk, 1024 * 1024);
+    memset(chunk.data, 'd', chunk.cap);
+    chunk.size = chunk.cap;
+
+    size_t ops = 512;
+    double t = now_ns();
+    for (size_t i = 0; i < ops; ++i) {
+        SB_push_back_many(&text, chunk.data, chunk.size);
+    }
+    report("append 512MB", ops, now_ns() - t, &c);
+
+    SB_destroy(&chunk);
+    SB_destroy(&text);
+}
+
+int main(void)
+{
+    printf("growth %d/%d, shrink at 1/%d to %dx, retain %d bytes, mremap %s\n\n",
+           DA_GROWTH_NUM, DA_GROWTH_DEN, DA_SHRINK_DIV, DA_SHRINK_MUL,
+           DA_MIN_RETAIN,
+#ifdef DA_USE_MREMAP
+           "on"
+#else
+           "off"
+#endif
+           );
+
+    printf("%-22s %10s %10s %10s %12s\n",
+           "pattern", "ops", "ns/op", "resizes", "moved MB");
+
+    bench_type_backspace();
+    bench_boundary();
+    bench_paste_undo();
+    bench_clipboard();
+    bench_line_index();
+    bench_large_append();
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+#!/bin/bash
+
+# Replays every key script on every corpus file with the headless editor,
+# then runs the da.h microbenchmarks. Run ./build.sh bench first.
+
+cd "$(dirname "$0")"
+
+DATA=data
+
+for file in server.log min.json cjk.txt source.c; do
+    for keys in scroll page region edit search goto multi block; do
+        echo "== $file, $keys"
+        ./ted --bench $DATA/$keys.keys $DATA/$file
+        echo
+    done
+done
+
+for file in server.log min.json; do
+    for keys in scroll page goto; do
+        echo "== $file, $keys, -R"
+        ./ted --bench $DATA/$keys.keys -R $DATA/$file
+        echo
+    done
+done
+
+# --cache: the first open scans the file and writes its line index, the
+# second one reads it
+rm -rf $DATA/cache
+for run in scan index; do
+    for flags in "" -R; do
+        echo "== server.log, goto, --cache $flags ($run)"
+        XDG_CACHE_HOME=$DATA/cache ./ted --cache --bench $DATA/goto.keys \
+            $flags $DATA/server.log
+        echo
+    done
+done
+rm -rf $DATA/cache
+
+# --batch against sed on 1000 pieces of source.c, both must give the same
+# files
+rm -rf $DATA/batch && mkdir -p $DATA/batch/ted $DATA/batch/sed
+head -c 32000000 $DATA/source.c | split -b 32000 -a 3 - $DATA/batch/ted/f
+cp $DATA/batch/ted/f* $DATA/batch/sed
+echo "== batch, 1000 files"
+./ted --batch $DATA/batch.script $DATA/batch/ted/f*
+echo "== sed, 1000 files"
+time sed -i -f $DATA/batch.sed $DATA/batch/sed/f*
+diff -rq $DATA/batch/ted $DATA/batch/sed || echo "batch and sed differ"
+rm -rf $DATA/batch
+echo
+
+echo "== da.h"
+./da_bench
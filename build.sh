@@ -3,13 +3,24 @@
 # debug build
 CC='gcc'
 CFLAGS='-Wall -Wextra -Wno-unused-function -fsanitize=address'
-LDFLAGS=''
+LDFLAGS='-pthread'
 
 # static release build
 # CC='gcc'
 # CFLAGS='-Wall -Wextra -std=c99 -pedantic'
-# LDFLAGS='-static'
+# LDFLAGS='-static -pthread'
 
 set -xe
 
+# ./build.sh bench: optimized headless editor, corpus and benchmarks
+if [ "$1" = "bench" ]; then
+    BENCH_FLAGS="-O2 -Wall -Wextra -Wno-unused-function $BENCH_CFLAGS"
+    $CC $BENCH_FLAGS -o bench/ted ted.c -pthread
+    $CC $BENCH_FLAGS -o bench/da_bench bench/da_bench.c
+    $CC $BENCH_FLAGS -o bench/corpus bench/corpus.c
+    [ -d bench/data ] || (mkdir bench/data && ./bench/corpus bench/data)
+    ./bench/run.sh
+    exit
+fi
+
 $CC $CFLAGS -o ted ted.c $LDFLAGS
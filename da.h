@@ -1,23 +1,57 @@
 /*
  * Dynamic array header - last edited by zer0 on 24 Jun 2025
  * Written in C99.
- * 
+ *
  * Usage:
- * 
+ *
  * 1.  DA_TYPEDEF(type, name) to define a struct with the specified name
  * 2.  name_create() to allocate memory and return struct by value
+ *     (or name_create_with(DA_Allocator *) to take memory from an arena,
+ *     a pool or any other allocator)
  * 3.  Optionally initialize the memory by calling name_init_with_zeros(name *)
  * ... Do whatever
  * n.  name_destroy(type *) to free memory
  *
  * All allocated memory is not initialized by default.
- * 
+ *
  * DA_INIT_CAP sets the initial capacity of the array. Capacity can't go below
  * it by using generated functions (is this the right way to do this?). Only
  * name_destroy(name *) sets the capacity to 0.
  *
  * malloc and realloc were used, so calculated values are not protected from
- * overflow (you shouldn't allocate that much memory anyway).
+ * overflow (you shouldn't allocate that much memory anyway). Only the byte
+ * size passed to the allocator is checked.
+ *
+ * Allocators:
+ *
+ * A DA_Allocator is one resize function in the style of realloc that also
+ * gets the old size (new_size == 0 frees). A NULL allocator, which is what
+ * a zeroed struct has, means the system heap. da.h comes with:
+ *
+ * -   DA_Arena: bump allocator for temporaries, da_arena_reset() gives all
+ *     memory back at once and keeps the blocks for reuse
+ * -   DA_Pool: fixed-size nodes with a free list
+ *
+ * By default failed allocations assert. With DA_NO_ASSERT defined the
+ * generated functions that allocate return DA_ERR_NOMEM instead and leave
+ * the array as it was.
+ *
+ * Growth policy:
+ *
+ * Define these before including da.h to change them (bench/da_bench.c
+ * compares settings):
+ *
+ * -   DA_GROWTH_NUM / DA_GROWTH_DEN: capacity factor when the array is full
+ * -   DA_SHRINK_DIV: shrink once size <= cap / DA_SHRINK_DIV
+ * -   DA_SHRINK_MUL: ...down to size * DA_SHRINK_MUL, so the array has to
+ *     grow or shrink by a large factor again before the next realloc
+ * -   DA_MIN_RETAIN: bytes that shrinking and name_clear never give back
+ *
+ * With DA_USE_MREMAP defined (Linux, needs _GNU_SOURCE) heap arrays of at
+ * least DA_MREMAP_THRESHOLD bytes live in their own mapping and grow with
+ * mremap, which moves pages instead of copying them. glibc's realloc does
+ * the same for large blocks already, so this is for other C libraries.
+ * Don't free() their data yourself, use name_destroy.
  */
 
 #ifndef DA_H_
@@ -28,57 +62,377 @@
 #include <assert.h>
 #include <stdbool.h>
 
+#ifdef DA_USE_MREMAP
+#include <sys/mman.h>
+#endif
+
 #define DA_INIT_CAP 128
+#define DA_ALIGN 16
+
+#ifndef DA_GROWTH_NUM
+#define DA_GROWTH_NUM 2
+#endif
+#ifndef DA_GROWTH_DEN
+#define DA_GROWTH_DEN 1
+#endif
+#ifndef DA_SHRINK_DIV
+#define DA_SHRINK_DIV 8
+#endif
+#ifndef DA_SHRINK_MUL
+#define DA_SHRINK_MUL 4
+#endif
+#ifndef DA_MIN_RETAIN
+#define DA_MIN_RETAIN 4096
+#endif
+#ifndef DA_MREMAP_THRESHOLD
+#define DA_MREMAP_THRESHOLD (64 * 1024 * 1024)
+#endif
+
+#if DA_GROWTH_NUM <= DA_GROWTH_DEN
+#error "DA_GROWTH_NUM / DA_GROWTH_DEN must be above 1"
+#endif
+#if DA_SHRINK_MUL < 1 || DA_SHRINK_MUL >= DA_SHRINK_DIV
+#error "DA_SHRINK_MUL must be in [1, DA_SHRINK_DIV)"
+#endif
+
+#define DA_OK 0
+#define DA_ERR_NOMEM (-1)
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+#ifdef DA_NO_ASSERT
+#define DA_CHECK_ALLOC(p) do { if (!(p)) return DA_ERR_NOMEM; } while (0)
+#define DA_CHECK_CREATE(p) ((void)0)
+#else
+#define DA_CHECK_ALLOC(p) assert((p) && "Buy more RAM")
+#define DA_CHECK_CREATE(p) assert((p) && "Buy more RAM")
+#endif
+
+typedef void *(*DA_Resize_Fn)(void   *ctx,
+                              void   *ptr,
+                              size_t  old_size,
+                              size_t  new_size);
+
+typedef struct DA_Allocator {
+    DA_Resize_Fn resize;
+    void *ctx;
+} DA_Allocator;
+
+#ifdef DA_USE_MREMAP
+// Which side of the threshold a block is on follows from its size alone, so
+// the old size tells whether ptr came from malloc or mmap.
+static void *da_mremap_resize(void *ptr, size_t old_size, size_t new_size)
+{
+    bool old_mapped = ptr != NULL && old_size >= DA_MREMAP_THRESHOLD;
+    bool new_mapped = new_size >= DA_MREMAP_THRESHOLD;
+    void *p;
+
+    if (old_mapped && new_mapped) {
+        p = mremap(ptr, old_size, new_size, MREMAP_MAYMOVE);
+        return p == MAP_FAILED ? NULL : p;
+    }
+
+    if (new_size == 0) {
+        p = NULL;
+    } else if (new_mapped) {
+        p = mmap(NULL, new_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return NULL;
+    } else {
+        p = malloc(new_size);
+        if (p == NULL) return NULL;
+    }
+
+    if (ptr) {
+        if (p) memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+        if (old_mapped) munmap(ptr, old_size);
+        else free(ptr);
+    }
+    return p;
+}
+#endif
+
+static void *da_resize(DA_Allocator *al,
+                       void         *ptr,
+                       size_t        old_size,
+                       size_t        new_size)
+{
+    if (al == NULL) {
+#ifdef DA_USE_MREMAP
+        if (old_size >= DA_MREMAP_THRESHOLD ||
+            new_size >= DA_MREMAP_THRESHOLD) {
+            return da_mremap_resize(ptr, old_size, new_size);
+        }
+#endif
+        if (new_size == 0) {
+            free(ptr);
+            return NULL;
+        }
+        return realloc(ptr, new_size);
+    }
+    return al->resize(al->ctx, ptr, old_size, new_size);
+}
+
+// #########################################################################
+// Arena
+// #########################################################################
+
+typedef struct DA_Arena_Block {
+    struct DA_Arena_Block *next;
+    size_t used;
+    size_t cap;
+    char *data;
+} DA_Arena_Block;
+
+typedef struct DA_Arena {
+    DA_Allocator alloc; // pass &arena.alloc to name_create_with
+    DA_Arena_Block *first;
+    DA_Arena_Block *current;
+    size_t block_size;
+    char *last; // last allocation, can grow in place
+} DA_Arena;
+
+static void *da_arena_push(DA_Arena *ar, size_t n)
+{
+    DA_Arena_Block *b = ar->current;
+
+    while (b) {
+        size_t at = (b->used + DA_ALIGN - 1) & ~(size_t)(DA_ALIGN - 1);
+        if (at + n <= b->cap) {
+            b->used = at + n;
+            ar->current = b;
+            ar->last = &b->data[at];
+            return ar->last;
+        }
+        b = b->next;
+    }
+
+    // blocks are allocated once and kept by da_arena_reset
+    size_t cap = MAX(ar->block_size, n);
+    b = malloc(sizeof(DA_Arena_Block) + cap + DA_ALIGN);
+    if (b == NULL) return NULL;
+
+    b->data = (char *)(((size_t)(b + 1) + DA_ALIGN - 1) &
+                       ~(size_t)(DA_ALIGN - 1));
+    b->cap = cap;
+    b->used = n;
+
+    if (ar->current) {
+        b->next = ar->current->next;
+        ar->current->next = b;
+    } else {
+        b->next = NULL;
+        ar->first = b;
+    }
+    ar->current = b;
+    ar->last = b->data;
+
+    return b->data;
+}
+
+static void *da_arena_resize(void   *ctx,
+                             void   *ptr,
+                             size_t  old_size,
+                             size_t  new_size)
+{
+    DA_Arena *ar = ctx;
+    DA_Arena_Block *b = ar->current;
+
+    if (ptr != NULL && ptr == ar->last) {
+        size_t at = (char *)ptr - b->data;
+
+        if (new_size == 0) {
+            b->used = at;
+            ar->last = NULL;
+            return NULL;
+        }
+        if (at + new_size <= b->cap) {
+            b->used = at + new_size;
+            return ptr;
+        }
+    }
+
+    if (new_size == 0) return NULL; // only the last allocation is given back
+
+    void *p = da_arena_push(ar, new_size);
+    if (p && ptr) memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+    return p;
+}
+
+static void da_arena_init(DA_Arena *ar, size_t block_size)
+{
+    memset(ar, 0, sizeof(DA_Arena));
+    ar->alloc.resize = da_arena_resize;
+    ar->alloc.ctx = ar;
+    ar->block_size = block_size;
+}
+
+static void da_arena_reset(DA_Arena *ar)
+{
+    for (DA_Arena_Block *b = ar->first; b; b = b->next) b->used = 0;
+    ar->current = ar->first;
+    ar->last = NULL;
+}
+
+static void da_arena_destroy(DA_Arena *ar)
+{
+    DA_Arena_Block *b = ar->first;
+    while (b) {
+        DA_Arena_Block *next = b->next;
+        free(b);
+        b = next;
+    }
+    memset(ar, 0, sizeof(DA_Arena));
+}
+
+// #########################################################################
+// Pool
+// #########################################################################
+
+typedef struct DA_Pool {
+    DA_Allocator alloc; // pass &pool.alloc to name_create_with
+    size_t node_size;
+    size_t nodes_per_block;
+    void *free_list;
+    void *blocks; // first node of every block links to the next block
+} DA_Pool;
+
+static void *da_pool_resize(void   *ctx,
+                            void   *ptr,
+                            size_t  old_size,
+                            size_t  new_size)
+{
+    DA_Pool *p = ctx;
+    (void)old_size;
+
+    if (new_size == 0) {
+        if (ptr) {
+            *(void **)ptr = p->free_list;
+            p->free_list = ptr;
+        }
+        return NULL;
+    }
+    if (new_size > p->node_size) return NULL;
+    if (ptr) return ptr;
+
+    if (p->free_list == NULL) {
+        char *block = malloc(p->node_size * (p->nodes_per_block + 1));
+        if (block == NULL) return NULL;
+
+        *(void **)block = p->blocks;
+        p->blocks = block;
+
+        for (size_t i = p->nodes_per_block; i > 0; --i) {
+            char *node = block + i * p->node_size;
+            *(void **)node = p->free_list;
+            p->free_list = node;
+        }
+    }
+
+    void *node = p->free_list;
+    p->free_list = *(void **)node;
+    return node;
+}
+
+static void da_pool_init(DA_Pool *p, size_t node_size, size_t nodes_per_block)
+{
+    memset(p, 0, sizeof(DA_Pool));
+    p->alloc.resize = da_pool_resize;
+    p->alloc.ctx = p;
+
+    size_t align = DA_ALIGN;
+    p->node_size = (MAX(node_size, sizeof(void *)) + align - 1) & ~(align - 1);
+    p->nodes_per_block = MAX(nodes_per_block, 1);
+}
+
+static void da_pool_destroy(DA_Pool *p)
+{
+    void *block = p->blocks;
+    while (block) {
+        void *next = *(void **)block;
+        free(block);
+        block = next;
+    }
+    memset(p, 0, sizeof(DA_Pool));
+}
+
+// #########################################################################
+// Dynamic array
+// #########################################################################
+
 #define DA_TYPEDEF(T, name) \
 typedef struct name {       \
     T* data;                \
     size_t size;            \
     size_t cap;             \
+    DA_Allocator *alloc;    \
 } name;                     \
 \
+static int name##_set_cap(name *a, size_t new_cap)                      \
+{                                                                       \
+    T *data = NULL;                                                     \
+    if (new_cap <= (size_t)-1 / sizeof(T)) {                            \
+        data = da_resize(a->alloc, a->data,                             \
+                         sizeof(T) * a->cap, sizeof(T) * new_cap);      \
+    }                                                                   \
+    DA_CHECK_ALLOC(data);                                               \
+                                                                        \
+    a->data = data;                                                     \
+    a->cap = new_cap;                                                   \
+    return DA_OK;                                                       \
+}                                                                       \
+\
+static name name##_create_with(DA_Allocator *alloc)         \
+{                                                           \
+    name a;                                                 \
+                                                            \
+    a.alloc = alloc;                                        \
+    a.cap = DA_INIT_CAP;                                    \
+    a.data = da_resize(alloc, NULL, 0, sizeof(T) * a.cap);  \
+    DA_CHECK_CREATE(a.data);                                \
+    if (a.data == NULL) a.cap = 0;                          \
+    a.size = 0;                                             \
+                                                            \
+    return a;                                               \
+}                                                           \
+\
 static name name##_create(void)             \
 {                                           \
-    name a;                                 \
-                                            \
-    a.cap = DA_INIT_CAP;                    \
-    a.data = malloc(sizeof(T) * a.cap);     \
-    assert(a.data && "Buy more RAM");       \
-    a.size = 0;                             \
-                                            \
-    return a;                               \
+    return name##_create_with(NULL);        \
 }                                           \
 \
-static void name##_destroy(name *a) \
-{                                   \
-    free(a->data);                  \
-    a->data = NULL;                 \
-    a->size = a->cap = 0;           \
-}                                   \
+static void name##_destroy(name *a)                         \
+{                                                           \
+    da_resize(a->alloc, a->data, sizeof(T) * a->cap, 0);    \
+    a->data = NULL;                                         \
+    a->size = a->cap = 0;                                   \
+}                                                           \
 \
 static void name##_init_with_zeros(name *a) \
 {                                           \
     memset(a->data, 0, sizeof(T) * a->cap); \
 }                                           \
 \
-static void name##_shrink_to_fit(name *a)               \
-{                                                       \
-    if (a->size <= a->cap / 4) {                        \
-        a->cap = MAX(DA_INIT_CAP, a->size * 2);         \
-        a->data = realloc(a->data, sizeof(T) * a->cap); \
-        assert(a->data && "Buy more RAM");              \
-    }                                                   \
-}                                                       \
+static size_t name##_retained_cap(void)                             \
+{                                                                   \
+    return MAX(DA_INIT_CAP, DA_MIN_RETAIN / sizeof(T));             \
+}                                                                   \
+\
+static int name##_shrink_to_fit(name *a)                            \
+{                                                                   \
+    size_t keep = name##_retained_cap();                            \
+    if (a->cap > keep && a->size <= a->cap / DA_SHRINK_DIV) {       \
+        return name##_set_cap(a, MAX(keep, a->size * DA_SHRINK_MUL));\
+    }                                                               \
+    return DA_OK;                                                   \
+}                                                                   \
 \
-static void name##_reserve_cap(name *a, size_t new_cap) \
+static int name##_reserve_cap(name *a, size_t new_cap)  \
 {                                                       \
     if (new_cap > a->cap) {                             \
-        a->cap = new_cap;                               \
-        a->data = realloc(a->data, sizeof(T) * a->cap); \
-        assert(a->data && "Buy more RAM");              \
+        return name##_set_cap(a, new_cap);              \
     }                                                   \
+    return DA_OK;                                       \
 }                                                       \
 \
 static T name##_at(const name *a, size_t i)             \
@@ -87,44 +441,44 @@ static T name##_at(const name *a, size_t i)             \
     return a->data[i];                                  \
 }                                                       \
 \
-static void name##_clear(name *a)                   \
-{                                                   \
-    a->size = 0;                                    \
-    a->cap = DA_INIT_CAP;                           \
-    a->data = realloc(a->data, sizeof(T) * a->cap); \
-    assert(a->data && "Buy more RAM");              \
-}                                                   \
+static int name##_clear(name *a)                \
+{                                               \
+    a->size = 0;                                \
+    if (a->cap > name##_retained_cap()) {       \
+        return name##_set_cap(a, name##_retained_cap()); \
+    }                                           \
+    return DA_OK;                               \
+}                                               \
+\
+static int name##_grow(name *a, size_t n)                               \
+{                                                                       \
+    size_t new_cap = a->cap;                                            \
+    while (a->size + n > new_cap) {                                     \
+        size_t next = new_cap / DA_GROWTH_DEN * DA_GROWTH_NUM;          \
+        new_cap = MAX(DA_INIT_CAP, MAX(next, new_cap + 1));             \
+    }                                                                   \
+    if (new_cap != a->cap) {                                            \
+        return name##_set_cap(a, new_cap);                              \
+    }                                                                   \
+    return DA_OK;                                                       \
+}                                                                       \
 \
-static void name##_push_back(name *a, T item)           \
+static int name##_push_back(name *a, T item)            \
 {                                                       \
-    bool needs_realloc = false;                         \
-    while (a->size + 1 > a->cap) {                      \
-        a->cap = MAX(DA_INIT_CAP, a->cap * 2);          \
-        needs_realloc = true;                           \
-    }                                                   \
-    if (needs_realloc) {                                \
-        a->data = realloc(a->data, sizeof(T) * a->cap); \
-        assert(a->data && "Buy more RAM");              \
-    }                                                   \
+    if (name##_grow(a, 1) != DA_OK) return DA_ERR_NOMEM;\
                                                         \
     a->data[a->size] = item;                            \
     a->size += 1;                                       \
+    return DA_OK;                                       \
 }                                                       \
 \
-static void name##_push_back_many(name *a, const T* items, size_t n)    \
+static int name##_push_back_many(name *a, const T* items, size_t n)     \
 {                                                                       \
-    bool needs_realloc = false;                                         \
-    while (a->size + n > a->cap) {                                      \
-        a->cap = MAX(DA_INIT_CAP, a->cap * 2);                          \
-        needs_realloc = true;                                           \
-    }                                                                   \
-    if (needs_realloc) {                                                \
-        a->data = realloc(a->data, sizeof(T) * a->cap);                 \
-        assert(a->data && "Buy more RAM");                              \
-    }                                                                   \
+    if (name##_grow(a, n) != DA_OK) return DA_ERR_NOMEM;                \
                                                                         \
     memcpy(&a->data[a->size], items, sizeof(T) * n);                    \
     a->size += n;                                                       \
+    return DA_OK;                                                       \
 }                                                                       \
 \
 static T name##_pop_back(name *a)                           \
@@ -134,35 +488,24 @@ static T name##_pop_back(name *a)                           \
     T item = a->data[a->size - 1];                          \
     a->size--;                                              \
                                                             \
-    if (a->size <= a->cap / 4) {                            \
-        a->cap = MAX(DA_INIT_CAP, a->size * 2);             \
-        a->data = realloc(a->data, sizeof(T) * a->cap);     \
-        assert(a->data && "Buy more RAM");                  \
-    }                                                       \
+    name##_shrink_to_fit(a); /* keeps the old block on failure */ \
                                                             \
     return item;                                            \
 }                                                           \
 \
-static void name##_push_many(name    *a,                                    \
-                             size_t   pos,                                  \
-                             const T *items,                                \
-                             size_t   n)                                    \
+static int name##_push_many(name    *a,                                     \
+                            size_t   pos,                                   \
+                            const T *items,                                 \
+                            size_t   n)                                     \
 {                                                                           \
     assert(pos <= a->size && "Can't insert at this position");              \
                                                                             \
-    bool needs_realloc = false;                                             \
-    while (a->size + n > a->cap) {                                          \
-        a->cap = MAX(DA_INIT_CAP, a->cap * 2);                              \
-        needs_realloc = true;                                               \
-    }                                                                       \
-    if (needs_realloc) {                                                    \
-        a->data = realloc(a->data, sizeof(T) * a->cap);                     \
-        assert(a->data && "Buy more RAM");                                  \
-    }                                                                       \
+    if (name##_grow(a, n) != DA_OK) return DA_ERR_NOMEM;                    \
                                                                             \
     memmove(&a->data[pos + n], &a->data[pos], sizeof(T) * (a->size - pos)); \
     memcpy(&a->data[pos], items, sizeof(T) * n);                            \
     a->size += n;                                                           \
+    return DA_OK;                                                           \
 }                                                                           \
 \
 static void name##_delete_many(name *a, size_t pos, size_t n)       \
@@ -175,11 +518,7 @@ static void name##_delete_many(name *a, size_t pos, size_t n)       \
             sizeof(T) * (a->size - (pos + n)));                     \
                                                                     \
     a->size -= n;                                                   \
-    if (a->size <= a->cap / 4) {                                    \
-        a->cap = MAX(DA_INIT_CAP, a->size * 2);                     \
-        a->data = realloc(a->data, sizeof(T) * a->cap);             \
-        assert(a->data && "Buy more RAM");                          \
-    }                                                               \
+    name##_shrink_to_fit(a); /* keeps the old block on failure */   \
 }
 
 #endif // DA_H_
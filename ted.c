@@ -1,14 +1,28 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
 #include <locale.h>
+#include <limits.h>
 
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "da.h"
 
@@ -17,6 +31,17 @@
 // #########################################################################
 
 #define INDENT_SPACES 4
+#define UNDO_MEMORY_CAP (64 * 1024 * 1024) // bytes kept by the undo journal
+#define SWAP_FLUSH_SIZE (64 * 1024)        // pending swap bytes before write
+#define SWAP_SYNC_INTERVAL_MS 2000         // fdatasync at most this often
+#define BENCH_WIDTH 80                     // virtual terminal of --bench
+#define BENCH_HEIGHT 24
+#define PROFILE_WINDOW 1024                // frames in the rolling histograms
+#define CACHE_MEMORY_BUDGET (64 * 1024 * 1024) // derived data, inactive buffers
+#define PAGER_WINDOW_SIZE (4 * 1024 * 1024)    // bytes of the file per mapping
+#define PAGER_WINDOWS 16                       // mappings kept by -R
+#define PAGER_CHECKPOINT 4096                  // lines per -R line index entry
+#define INDEX_MIN_SIZE (1024 * 1024)           // smaller files aren't indexed
 
 // #########################################################################
 // Constants
@@ -25,6 +50,24 @@
 #define MAX_WIDTH 256
 #define MAX_HEIGHT 256
 #define TEMP_BUF_SIZE 1024
+#define FRAME_ARENA_SIZE (64 * 1024)
+#define SWAP_MAGIC "TEDSWAP2"
+#define INDEX_MAGIC "TEDIDX02"
+#define NOT_FOUND ((u32)-1)
+#define PAGER_UNKNOWN ((u64)-1)
+#define RE_MAX_STATES 2048 // lazy DFA cache is flushed past this
+#define RE_MATCH_BIT (1u << 31)
+#define RE_DEAD_BIT (1u << 30)
+#define RE_ID_MASK (RE_DEAD_BIT - 1)
+#define RE_ROW 257 // transitions per DFA state, the last one is end of input
+#define POOL_MAX_THREADS 64
+#define COUNT_CHUNK_SIZE (4 * 1024 * 1024) // bytes searched per task
+#define RE_UNKNOWN ((u32)-1)
+#define RE_F_BOL 1       // previous byte was '\n' or there was none
+#define RE_F_NORESTART 2 // no new unanchored threads are started
+#define PROFILE_BUCKETS 124 // 4 per power of two up to 2^32 ns
+#define BRACKET_BLOCK 32       // slots per leaf of the bracket depth tree
+#define BRACKET_MIN_SLOTS 1024
 
 // #########################################################################
 // Utility macros
@@ -36,13 +79,22 @@
     utf8_bytesize_cache[(u8)(c)]    \
 )
 
-#define TERM_SET_CHAR(c, row_i, col_i)              \
-if (display_buffer[row_i][col_i].abs != (c).abs) {  \
-    display_buffer[row_i][col_i] = c;               \
-    dirty_buffer[row_i][col_i] = true;              \
-}
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define TERM_SET_CELL(c, attr, row_i, col_i)    \
+do {                                            \
+    frame_screen.glyphs[row_i][col_i] = c;      \
+    frame_screen.attrs[row_i][col_i] = attr;    \
+} while (0)
+
+// Cell attributes packed in a u32: foreground, background and flags.
+#define ATTR(fg, bg, flags) ((u32)(fg) | (u32)(bg) << 8 | (u32)(flags) << 16)
+#define ATTR_FG(a) ((a) & 0xff)
+#define ATTR_BG(a) (((a) >> 8) & 0xff)
+#define ATTR_FLAGS(a) (((a) >> 16) & 0xff)
+#define ATTR_WITH_BG(a, bg) (((a) & ~0xff00u) | (u32)(bg) << 8)
 
-#define TERM_MOVE_CURSOR(row, col) printf("\033[%d;%dH", row, col)
+#define TERM_MOVE_CURSOR(row, col) sb_appendf(&term_out, "\033[%d;%dH", row, col)
 
 #define CONTENTS_WIDTH (assert(term_width > 0), (u16)(term_width - 0))
 #define CONTENTS_HEIGHT (assert(term_height > 0), (u16)(term_height - 1))
@@ -68,17 +120,362 @@ typedef struct Line {
 typedef enum Mode {
     NORMAL_MODE = 0,
     INSERT_MODE = 1,
-    REGION_MODE = 2
+    REGION_MODE = 2,
+    SEARCH_MODE = 3,
+    GOTO_MODE = 4
 } Mode;
 
+// Target of ':', typed as 42 (line), 42% or 42b (byte offset).
+typedef enum Goto_Unit {
+    GOTO_LINE = 0,
+    GOTO_PERCENT = 1,
+    GOTO_BYTE = 2
+} Goto_Unit;
+
+typedef struct Goto {
+    u64 value;
+    Goto_Unit unit;
+} Goto;
+
+// One primitive edit: at offset, del_len bytes were replaced by ins_len
+// bytes. Both byte runs live in the journal arena starting at data
+// (inserted bytes first).
+typedef struct Edit {
+    u32 offset;
+    u32 data;
+    u32 ins_len;
+    u32 del_len;
+} Edit;
+
 DA_TYPEDEF(char, SB)
 DA_TYPEDEF(Line, Lines)
+DA_TYPEDEF(Edit, Edits)
+
+typedef struct Journal {
+    SB arena;
+    Edits edits;
+    u32 pos;     // edits[0..pos) can be undone, edits[pos..size) redone
+    bool sealed; // last edit can't be extended by the next insert
+} Journal;
+
+// Append-only crash recovery file next to the edited file. It holds a
+// header naming the version of the file on disk followed by raw edit
+// records: u32 offset, u32 del_len, u32 ins_len, ins_len bytes.
+typedef struct Swap_Header {
+    char magic[8];
+    u64 size;
+    u64 mtime_ns;
+    u64 ino;
+    u64 dev;
+} Swap_Header;
+
+typedef struct Swap {
+    s32 fd;     // -1 until the first record, viewing leaves no file
+    Swap_Header header;
+    SB path;
+    SB pending;
+    u64 last_sync_ms;
+    bool unsynced;
+    bool off; // headless runs don't leave swap files behind
+} Swap;
+
+// --cache: the line starts of a file, one index file per path in the
+// cache directory. The header tells which version of the file they belong
+// to, varints of the distances between every stride-th line start follow,
+// shifted left once for the ascii bit of the line there (Buffer.ascii).
+typedef struct Index_Header {
+    char magic[8];
+    u64 size;
+    u64 mtime_ns;
+    u64 ino;
+    u64 dev;
+    u64 stride;
+    u64 count; // line starts, the first one is 0
+    u64 bytes; // of varints
+} Index_Header;
+
+// An index file mapped for reading.
+typedef struct Index {
+    Index_Header header;
+    const u8 *map;
+    const u8 *at;
+    const u8 *end;
+    u64 value; // last line start read
+} Index;
+
+typedef enum Re_Op {
+    RE_BYTES = 0,
+    RE_SPLIT = 1,
+    RE_JMP = 2,
+    RE_BOL = 3,
+    RE_EOL = 4,
+    RE_MATCH = 5
+} Re_Op;
+
+typedef struct Re_Inst {
+    u8 op;
+    u32 x; // RE_BYTES: set index, RE_SPLIT and RE_JMP: target
+    u32 y; // RE_SPLIT: lower priority target
+} Re_Inst;
+
+typedef struct Re_Set {
+    u8 bits[32];
+} Re_Set;
+
+typedef enum Re_Kind {
+    RE_N_SET = 0,
+    RE_N_EMPTY = 1,
+    RE_N_BOL = 2,
+    RE_N_EOL = 3,
+    RE_N_CAT = 4,
+    RE_N_ALT = 5,
+    RE_N_STAR = 6,
+    RE_N_PLUS = 7,
+    RE_N_QUEST = 8
+} Re_Kind;
+
+typedef struct Re_Node {
+    u8 kind;
+    bool lazy;
+    u32 a; // RE_N_SET: set index
+    u32 b;
+} Re_Node;
+
+typedef struct Re_State {
+    u32 pcs;   // index of the thread list in Re_Dfa.pcs
+    u32 count;
+    u32 flags;
+} Re_State;
+
+DA_TYPEDEF(u8, U8s)
+DA_TYPEDEF(u32, U32s)
+DA_TYPEDEF(u64, U64s)
+DA_TYPEDEF(Re_Inst, Re_Insts)
+DA_TYPEDEF(Re_Set, Re_Sets)
+DA_TYPEDEF(Re_Node, Re_Nodes)
+DA_TYPEDEF(Re_State, Re_States)
+
+typedef struct Re {
+    Re_Sets sets;
+    Re_Insts fwd; // program of the pattern
+    Re_Insts rev; // program of the reversed pattern, finds match starts
+    SB prefix;    // literal every match starts with
+} Re;
+
+// Lazily built DFA over one program. Each state is an ordered list of
+// threads (highest priority first), transitions are filled on first use.
+// States are referred to by the index of their row in trans.
+typedef struct Re_Dfa {
+    const Re *re;
+    const Re_Insts *prog;
+    bool unanchored; // leftmost-first search, else longest anchored match
+    Re_States states;
+    U32s pcs;
+    U32s trans;  // RE_ROW per state
+    U32s table;  // open addressing, state id + 1
+    U32s list;   // closure scratch
+    U32s next;   // step scratch
+    U32s marks;  // per instruction, last generation that visited it
+    u32 gen;
+    u32 start[2]; // start states by RE_F_BOL
+    u32 flushes;
+} Re_Dfa;
+
+// Per thread search state for one Re.
+typedef struct Re_Cache {
+    Re_Dfa fwd;
+    Re_Dfa rev;
+} Re_Cache;
+
+// Searched text as a sequence of chunks, chunk() returns the length of
+// the contiguous run containing offset and where it begins.
+typedef struct Re_Input {
+    u32 (*chunk)(void *ctx, u32 offset, const char **data, u32 *begin);
+    void *ctx;
+    u32 size;
+} Re_Input;
+
+typedef void (*Task_Fn)(void *arg);
+
+typedef struct Task {
+    Task_Fn fn;
+    void *arg;
+} Task;
+
+DA_TYPEDEF(Task, Tasks)
+
+typedef struct Pool {
+    pthread_t threads[POOL_MAX_THREADS];
+    u32 thread_count;
+    pthread_mutex_t mutex;
+    pthread_cond_t has_work;
+    pthread_cond_t idle;
+    Tasks queue;
+    u32 head;  // next task to run in queue
+    u32 busy;  // tasks being run
+    bool stop;
+} Pool;
+
+typedef struct Count_Task {
+    struct Count *count;
+    u32 begin; // matches starting in [begin, end) belong to this task
+    u32 end;
+    u32 next;  // where the scan goes on after the last match
+    U32s matches;
+} Count_Task;
+
+// Counting all matches of a search on the pool. It reads the buffer
+// without a lock, so every edit cancels it first.
+typedef struct Count {
+    const char *data;
+    u32 size;
+    const char *query;
+    u32 query_len;
+    const Re *re; // NULL for literal search
+
+    Count_Task *tasks;
+    u32 task_count;
+    u32 remaining; // tasks not finished yet, atomic
+    u32 cancel;    // atomic
+
+    bool running;
+    bool done;
+    U32s matches; // sorted offsets, valid when done
+} Count;
+
+typedef struct Search {
+    SB query;
+    u32 origin; // cursor before the search started
+    bool backward;
+    bool found;
+
+    bool regex;
+    bool compiled;
+    const char *error;
+    Re re;
+    Re_Cache cache;
+    Count count;
+} Search;
+
+typedef enum Lang {
+    LANG_NONE = 0,
+    LANG_C = 1,
+    LANG_JSON = 2,
+    LANG_LOG = 3
+} Lang;
+
+typedef enum Style {
+    STYLE_NORMAL = 0,
+    STYLE_KEYWORD = 1,
+    STYLE_TYPE = 2,
+    STYLE_STRING = 3,
+    STYLE_NUMBER = 4,
+    STYLE_COMMENT = 5,
+    STYLE_PREPROC = 6,
+    STYLE_KEY = 7, // JSON object key
+    STYLE_ERROR = 8,
+    STYLE_WARNING = 9,
+    STYLE_INFO = 10,
+    STYLE_DEBUG = 11,
+    STYLE_COUNT = 12
+} Style;
+
+#define HL_C_COMMENT 1 // line starts inside /* */
+
+// Highlighter state at the start of every line, only C has state that
+// crosses lines. Rows below valid are exact. The rest were right before
+// the edits since and are trusted again once a recomputed state matches
+// the old one past damage_end, the last changed row.
+typedef struct Highlight {
+    Lang lang;
+    U8s states;
+    u32 valid;
+    u32 damage_end;
+} Highlight;
+
+// A bracket outside strings and comments. Before the gap of Brackets a
+// slot holds its offset and the depth after it. After the gap both count
+// from the end instead, the bytes to the end of data and the depth change
+// of the brackets that follow, so an edit at the gap doesn't touch them.
+typedef struct Bracket {
+    u32 offset;
+    s32 depth;
+} Bracket;
+
+// Depths of a run of slots: the least before the gap and the greatest as
+// stored after it.
+typedef struct Bracket_Range {
+    s32 lo;
+    s32 hi;
+} Bracket_Range;
+
+DA_TYPEDEF(Bracket, Bracket_Slots)
+DA_TYPEDEF(Bracket_Range, Bracket_Ranges)
+
+// The brackets of a buffer in a gap buffer kept at the last edit. tree is
+// a segment tree of depth ranges over blocks of BRACKET_BLOCK slots, it
+// finds the next or previous bracket within a depth, the match of a
+// bracket, in O(log n).
+typedef struct Brackets {
+    Bracket_Slots slots; // size is the capacity, a power of two
+    Bracket_Ranges tree; // tree[1] is the root, leaves are the last half
+    u32 gap_begin;
+    u32 gap_end;
+    u32 size;  // of data, the slots after the gap count from there
+    s32 depth; // after the last bracket
+    bool on;   // see brackets_build
+} Brackets;
+
+// The directory of the file is watched rather than the file itself, so a
+// file replaced by a rename (formatters, git checkout) is still seen.
+typedef struct Watch {
+    s32 fd;           // inotify
+    SB name;          // of the file within the directory, null terminated
+    SB dir;           // watched, null terminated
+    struct stat disk; // the file as last read or written
+    bool changed;     // changed on disk while the buffer had unsaved edits
+} Watch;
+
+// tail -f: other processes append to the file, the watch tells when, and
+// the new bytes from offset on are appended to the buffer.
+typedef struct Follow {
+    s32 fd;
+    u64 offset; // bytes of the file the buffer already has
+    bool on;
+} Follow;
+
+// A clipboard piece refers to a range of a buffer until the buffer is
+// about to change there, then its bytes are copied into the clipboard.
+typedef struct Clip_Piece {
+    const struct Buffer *source; // NULL once copied
+    u32 begin; // in the source's data, or in the clipboard's bytes
+    u32 len;
+} Clip_Piece;
+
+DA_TYPEDEF(Clip_Piece, Clip_Pieces)
+
+typedef struct Clipboard {
+    Clip_Pieces pieces; // in paste order
+    SB bytes;           // of the copied pieces
+    u64 size;
+    u64 chars; // UTF-8 characters, counted on append for the status line
+} Clipboard;
 
 typedef struct Buffer {
     SB data;
     SB path;
-    SB clipboard;
-    Lines lines;
+    Lines lines; // empty while released, see buffer_release_caches
+    U64s ascii;  // a bit per line: its columns are byte offsets, is_ascii
+    Clipboard *clipboard; // shared by the buffers of the editor
+    DA_Arena *arena; // temporaries, reset by the owner of the buffer
+    SB goto_input;   // target typed after ':'
+    Journal journal;
+    Swap swap;
+    Search search;
+    Highlight highlight;
+    Brackets brackets;
+    Watch watch;
+    Follow follow;
 
     Mode mode;
 
@@ -89,20 +486,145 @@ typedef struct Buffer {
     u32 region_begin;
     u32 region_end;
 
+    U32s cursors;    // multi-cursor: all of them sorted, empty when off
+    u32 cursor_main; // the one in cursors that is cursor
+
+    u64 last_active_ns; // picks the buffer whose caches go first
+
+    // bytes of a character typed so far, it's inserted once complete
+    char typed[4];
+    u8 typed_size;
+    u8 typed_count;
+
     bool saved;
+    bool batch; // --batch: no terminal, no counting on the pool
 } Buffer;
 
+DA_TYPEDEF(Buffer *, Buffers)
+
+typedef struct Pager_Window {
+    u64 begin; // file offset, a multiple of PAGER_WINDOW_SIZE
+    u64 size;
+    const char *data; // NULL while unused
+    u64 last_used;
+} Pager_Window;
+
+// -R: the file is read through a few mmap'd windows, never copied, and
+// lines are found by scanning from a known line start. The line index
+// only holds every PAGER_CHECKPOINT-th line start, as far as rows were
+// counted, so memory stays bounded whatever the file size.
+typedef struct Pager {
+    SB path;
+    s32 fd;
+    u64 size;
+    Pager_Window windows[PAGER_WINDOWS];
+    u64 clock;
+    U64s checkpoints; // checkpoints[i] begins row i * PAGER_CHECKPOINT
+    u64 indexed;      // checkpoints the index file has, see --cache
+    struct stat disk;
+    u64 top;          // first line on screen
+    u64 top_row;      // its row, PAGER_UNKNOWN if reached from the end
+    bool going_to;    // typing the target of ':'
+    SB goto_input;
+} Pager;
+
+// --batch script: one command per line, applied to every file in turn.
+typedef enum Batch_Op {
+    BATCH_KEYS = 0,          // keys text: typed like in the editor
+    BATCH_REPLACE = 1,       // r/from/to/: every literal match
+    BATCH_REPLACE_REGEX = 2  // s/from/to/: every regex match
+} Batch_Op;
+
+typedef struct Batch_Command {
+    Batch_Op op;
+    SB arg;
+    SB with;
+} Batch_Command;
+
+DA_TYPEDEF(Batch_Command, Batch_Commands)
+
+typedef struct Batch_Job {
+    const char *path;
+    const Batch_Commands *script;
+    u64 bytes;   // size of the file as read
+    u32 matches; // replaced by the r and s commands
+    bool ok;
+} Batch_Job;
+
 typedef union Utf8_Char {
     char arr[5]; // 5th for null byte for printf
     u32 abs;
 } Utf8_Char;
 
+// 0 is the terminal default, then the 8 ANSI colors and their bright
+// variants.
+typedef enum Color {
+    COLOR_DEFAULT = 0,
+    COLOR_BLACK = 1,
+    COLOR_RED = 2,
+    COLOR_GREEN = 3,
+    COLOR_YELLOW = 4,
+    COLOR_BLUE = 5,
+    COLOR_MAGENTA = 6,
+    COLOR_CYAN = 7,
+    COLOR_WHITE = 8,
+    COLOR_BRIGHT_BLACK = 9 // up to 16 for bright white
+} Color;
+
+#define ATTR_BOLD 1
+#define ATTR_DIM 2
+#define ATTR_UNDERLINE 4
+#define ATTR_REVERSE 8
+
+// Screen cells as planes: glyphs and packed attributes side by side, so
+// the diff in term_display compares each with a single load.
+typedef struct Screen {
+    Utf8_Char glyphs[MAX_HEIGHT][MAX_WIDTH];
+    u32 attrs[MAX_HEIGHT][MAX_WIDTH];
+} Screen;
+
+typedef enum Phase {
+    PHASE_INPUT = 0,    // read of the key
+    PHASE_DISPATCH = 1, // handle_key, tokenize included
+    PHASE_TOKENIZE = 2,
+    PHASE_RENDER = 3,   // filling and diffing the display buffer
+    PHASE_DISPLAY = 4,  // term_display
+    PHASE_FLUSH = 5,    // writing the frame out
+    PHASE_COUNT = 6
+} Phase;
+
+// Latencies in log-linear buckets, percentiles are exact to a quarter of
+// a power of two.
+typedef struct Histogram {
+    u32 counts[PROFILE_BUCKETS];
+    u64 samples;
+    u64 sum_ns;
+    u32 max_ns;
+} Histogram;
+
+// Phase timings of every frame. The recent histograms hold the last
+// PROFILE_WINDOW samples of each phase, the ring remembers which ones to
+// take out again.
+typedef struct Profile {
+    u64 frame_ns[PHASE_COUNT];
+    bool ran[PHASE_COUNT];
+    u32 last_ns[PHASE_COUNT]; // last finished frame, 0 if the phase didn't run
+
+    u32 ring[PHASE_COUNT][PROFILE_WINDOW];
+    u32 ring_pos[PHASE_COUNT];
+    Histogram recent[PHASE_COUNT];
+    Histogram all[PHASE_COUNT];
+
+    bool shown; // timings replace the status line
+} Profile;
+
 // #########################################################################
 // Render functions
 // #########################################################################
 
 static void term_clear(void);
 static void term_display(void);
+static void term_flush(void);
 static void render(Buffer *b);
 
 // #########################################################################
@@ -113,6 +635,12 @@ static u32 get_cursor_row(Buffer *b);
 static u32 update_row_offset(Buffer *b);
 static u32 update_last_visual_col(Buffer *b);
 static void set_cursor_col_after_vertical_move(Buffer *b, Line next_line);
+static u32 line_offset_at_visual_col(const Buffer *b, Line line, u32 col);
+static u32 u32s_find(const U32s *a, u32 value);
+static void sb_appendf(SB *sb, const char *fmt, ...);
+static bool goto_parse(const SB *input, Goto *g);
+static u64 count_utf8_chars(const char *s, u32 n);
+static bool is_ascii(const char *s, u32 n);
 
 // #########################################################################
 // Misc functions
@@ -120,12 +648,205 @@ static void set_cursor_col_after_vertical_move(Buffer *b, Line next_line);
 
 static void cache_utf8_bytesize(void);
 static void signal_handler(s32 signum);
+static u64 time_ms(void);
+static u64 time_ns(void);
+
+// #########################################################################
+// Profile functions
+// #########################################################################
+
+static void profile_add(Phase phase, u64 start_ns);
+static void profile_commit(void);
+static void profile_status(SB *status);
+static bool profile_dump(const char *path);
 
 // #########################################################################
 // Lines functions
 // #########################################################################
 
-static u32 tokenize_lines(Lines *lines, SB *sb);
+static u32 tokenize_lines(Lines *lines, U64s *ascii, SB *sb);
+static void lines_scan(Lines    *lines,
+                       U64s     *ascii,
+                       const SB *sb,
+                       u32       begin,
+                       u32       end);
+static void lines_edit(Lines     *lines,
+                       U64s      *ascii,
+                       const SB  *sb,
+                       u32        row,
+                       u32        removed,
+                       u32        added,
+                       u32        del_len,
+                       u32        ins_len);
+static u32 lines_find_row(const Lines *lines, u32 offset);
+static u32 count_newlines(const char *s, u32 n);
+static void lines_append(Lines    *lines,
+                         U64s     *ascii,
+                         const SB *sb,
+                         u32       from);
+static bool bit_get(const U64s *bits, u32 i);
+static void bits_fit(U64s *bits, u32 count);
+static void bit_set(U64s *bits, u32 i, bool on);
+static void bits_move(U64s *bits, u32 to, u32 from, u32 n);
+
+// #########################################################################
+// Search functions
+// #########################################################################
+
+static u32 find_forward(const char *hay,
+                        u32         n,
+                        const char *needle,
+                        u32         m);
+static u32 find_backward(const char *hay,
+                         u32         n,
+                         const char *needle,
+                         u32         m);
+static u32 search_from(Buffer *b, u32 from, bool backward);
+static u32 search_regex_before(Buffer *b, u32 before);
+static u32 buffer_chunk(void *ctx, u32 offset, const char **data, u32 *begin);
+static void count_start(Search *s, const SB *data);
+static void count_cancel(Count *c);
+static void count_poll(Count *c);
+static u32 count_find(const Count *c, u32 offset);
+static u32 replace_all(Buffer     *b,
+                       const char *pattern,
+                       u32         pattern_len,
+                       bool        regex,
+                       const char *with,
+                       u32         with_len);
+
+// #########################################################################
+// Highlight functions
+// #########################################################################
+
+static void highlight_create(Highlight *h, const char *path);
+static void highlight_destroy(Highlight *h);
+static void highlight_reset(Highlight *h);
+static void highlight_edit(Highlight *h, u32 row, u32 removed, u32 added);
+static void highlight_sync(Buffer *b, u32 until_row);
+static u8 highlight_state(const Highlight *h, u32 row);
+static u8 highlight_line(Lang        lang,
+                         const char *s,
+                         u32         len,
+                         u32         stop,
+                         u8          state,
+                         u8         *styles);
+
+// #########################################################################
+// Bracket functions
+// #########################################################################
+
+static void brackets_build(Buffer *b);
+static void brackets_destroy(Brackets *br);
+static void brackets_edit(Buffer *b,
+                          u32     row,
+                          u32     added,
+                          u32     offset,
+                          u32     ins_len);
+static u32 brackets_match(const Buffer *b, u32 offset);
+static u32 brackets_next_block(const Buffer *b, u32 offset);
+static u32 brackets_prev_block(const Buffer *b, u32 offset);
+
+// #########################################################################
+// Pool functions
+// #########################################################################
+
+static void pool_create(Pool *p, u32 thread_count);
+static void pool_destroy(Pool *p);
+static void pool_submit(Pool *p, Task_Fn fn, void *arg);
+static void pool_wait(Pool *p);
+
+// #########################################################################
+// Regex functions
+// #########################################################################
+
+static const char *re_compile(Re           *re,
+                              const char   *pattern,
+                              u32           len,
+                              DA_Allocator *scratch);
+static void re_destroy(Re *re);
+static void re_cache_create(Re_Cache *c, const Re *re);
+static void re_cache_destroy(Re_Cache *c);
+static bool re_search(Re_Cache      *c,
+                      const Re_Input *in,
+                      u32            from,
+                      u32            limit,
+                      u32           *begin,
+                      u32           *end);
+
+// #########################################################################
+// Journal functions
+// #########################################################################
+
+static void journal_create(Journal *j);
+static void journal_destroy(Journal *j);
+static void journal_clear(Journal *j);
+static void journal_seal(Journal *j);
+static void journal_record(Journal    *j,
+                           u32         offset,
+                           const char *ins,
+                           u32         ins_len,
+                           const char *del,
+                           u32         del_len);
+static void journal_trim(Journal *j);
+static void journal_amend(Journal *j, const char *ins, u32 ins_len);
+
+// #########################################################################
+// Swap functions
+// #########################################################################
+
+static bool swap_open(Swap *s, const char *path, const struct stat *st);
+static void swap_reset(Swap *s, const struct stat *st);
+static void swap_close(Swap *s, bool keep_file);
+static void swap_record(Swap       *s,
+                        u32         offset,
+                        u32         del_len,
+                        const char *ins,
+                        u32         ins_len);
+static void swap_flush(Swap *s, bool sync);
+static bool swap_replay(Swap *s, SB *data);
+
+// #########################################################################
+// Index functions
+// #########################################################################
+
+static void cache_dir_open(void);
+static u64 index_mtime_ns(const struct stat *st);
+static bool index_path(const char *path, u64 stride, SB *out);
+static bool index_open(Index             *x,
+                       const char        *path,
+                       const struct stat *st,
+                       u64                stride);
+static bool index_next(Index *x, u64 *start, bool *flag);
+static void index_close(Index *x);
+static void index_put(SB *varints, u64 delta, bool flag);
+static void index_write(const char        *path,
+                        const struct stat *st,
+                        u64                stride,
+                        u64                count,
+                        const SB          *varints);
+static bool index_load_lines(Lines *lines, U64s *ascii, const char *path,
+                             const struct stat *st);
+static void index_store_lines(const Lines *lines, const U64s *ascii,
+                              const char *path, const struct stat *st);
+
+// #########################################################################
+// Watch functions
+// #########################################################################
+
+static void watch_start(Buffer *b);
+static void watch_subscribe(Watch *w, bool growth);
+static void watch_stop(Buffer *b);
+static bool watch_update(Buffer *b);
+static size_t re_cache_bytes(const Re_Cache *c);
+
+// #########################################################################
+// Follow functions
+// #########################################################################
+
+static bool follow_start(Buffer *b);
+static void follow_stop(Buffer *b);
+static bool follow_update(Buffer *b);
 
 // #########################################################################
 // Buffer functions
@@ -133,7 +854,34 @@ static u32 tokenize_lines(Lines *lines, SB *sb);
 
 static u32 buffer_create_from_file(Buffer *b, const char *path);
 static void buffer_save(Buffer *b);
+static bool buffer_reload(Buffer *b);
 static void buffer_kill(Buffer *b);
+static size_t buffer_cache_bytes(const Buffer *b);
+static void buffer_release_caches(Buffer *b);
+static void buffer_activate(Buffer *b);
+static void buffers_trim(void);
+static void buffer_apply(Buffer     *b,
+                         u32         offset,
+                         u32         del_len,
+                         const char *ins,
+                         u32         ins_len);
+static void buffer_splice(Buffer     *b,
+                          u32         offset,
+                          u32         del_len,
+                          const char *ins,
+                          u32         ins_len);
+static void buffer_insert(Buffer *b, u32 offset, const char *s, u32 n);
+static void buffer_delete(Buffer *b, u32 offset, u32 n);
+
+// #########################################################################
+// Clipboard functions
+// #########################################################################
+
+static void clipboard_destroy(Clipboard *c);
+static void clipboard_clear(Clipboard *c);
+static void clipboard_append(Clipboard *c, const Buffer *b, u32 begin, u32 len);
+static void clipboard_detach(Clipboard *c, const Buffer *b, u32 from);
+static const char *clipboard_data(Clipboard *c, const Buffer *target);
 
 // #########################################################################
 // Editor functions
@@ -154,6 +902,12 @@ static void center_cursor_line(Buffer *b);
 static void insert_char_at_cursor(Buffer *b, char c);
 static void insert_indent_spaces_at_cursor(Buffer *b);
 static void backspace(Buffer *b);
+static void multi_cursor_start(Buffer *b);
+static void multi_cursor_stop(Buffer *b);
+static void multi_cursor_edit(Buffer     *b,
+                              bool        erase,
+                              const char *ins,
+                              u32         ins_len);
 static void begin_region(Buffer *b);
 static void end_region(Buffer *b);
 static void discard_region(Buffer *b);
@@ -162,6 +916,52 @@ static void cut_region_append(Buffer *b);
 static void delete_region(Buffer *b);
 static void paste_clipboard_at_cursor(Buffer *b);
 static void clear_clipboard(Buffer *b);
+static void switch_buffer(s32 step);
+static void undo(Buffer *b);
+static void redo(Buffer *b);
+static void begin_search(Buffer *b, bool backward);
+static void update_search(Buffer *b);
+static void end_search(Buffer *b, bool accept);
+static void repeat_search(Buffer *b, bool backward);
+static void goto_target(Buffer *b, Goto g);
+static void move_to_bracket(Buffer *b, u32 offset);
+static bool handle_key(Buffer *b, char c);
+static bool handle_key_current(char c);
+static void render_current(void);
+
+// #########################################################################
+// Pager functions
+// #########################################################################
+
+static bool pager_open(Pager *p, const char *path);
+static void pager_close(Pager *p);
+static void pager_store_index(Pager *p);
+static void pager_clamp(Pager *p);
+static u64 pager_span(Pager *p, u64 offset, const char **data);
+static u64 pager_line_end(Pager *p, u64 begin);
+static u64 pager_line_begin(Pager *p, u64 offset);
+static void pager_down(Pager *p, u64 n);
+static void pager_up(Pager *p, u64 n);
+static void pager_bottom(Pager *p);
+static void pager_goto(Pager *p, Goto g);
+static void pager_render(Pager *p);
+static bool pager_handle_key(Pager *p, char c);
+
+// #########################################################################
+// Bench functions
+// #########################################################################
+
+static void bench_replay(const char *keys_path, u64 load_ns);
+
+// #########################################################################
+// Batch functions
+// #########################################################################
+
+static bool batch_parse(const char *script_path, Batch_Commands *script);
+static void batch_run_file(void *arg);
+static bool batch_run(const char  *script_path,
+                      const char **paths,
+                      u32          paths_count);
 
 // #########################################################################
 // Global variables
@@ -169,14 +969,52 @@ static void clear_clipboard(Buffer *b);
 
 u8 utf8_bytesize_cache[256] = {0};
 
-Utf8_Char display_buffer[MAX_HEIGHT][MAX_WIDTH] = {0};
+// display_screen is what the terminal shows, frame_screen the frame being
+// rendered. term_display writes out the cells that differ or are dirty.
+Screen display_screen = {0};
+Screen frame_screen = {0};
 bool dirty_buffer[MAX_HEIGHT][MAX_WIDTH] = {0};
-
+u32 term_attr = 0; // attributes the terminal draws with right now
+
+const u32 style_attrs[STYLE_COUNT] = {
+    [STYLE_NORMAL]  = ATTR(COLOR_DEFAULT, COLOR_DEFAULT, 0),
+    [STYLE_KEYWORD] = ATTR(COLOR_MAGENTA, COLOR_DEFAULT, 0),
+    [STYLE_TYPE]    = ATTR(COLOR_CYAN, COLOR_DEFAULT, 0),
+    [STYLE_STRING]  = ATTR(COLOR_GREEN, COLOR_DEFAULT, 0),
+    [STYLE_NUMBER]  = ATTR(COLOR_YELLOW, COLOR_DEFAULT, 0),
+    [STYLE_COMMENT] = ATTR(COLOR_DEFAULT, COLOR_DEFAULT, ATTR_DIM),
+    [STYLE_PREPROC] = ATTR(COLOR_RED, COLOR_DEFAULT, 0),
+    [STYLE_KEY]     = ATTR(COLOR_BLUE, COLOR_DEFAULT, 0),
+    [STYLE_ERROR]   = ATTR(COLOR_RED, COLOR_DEFAULT, ATTR_BOLD),
+    [STYLE_WARNING] = ATTR(COLOR_YELLOW, COLOR_DEFAULT, ATTR_BOLD),
+    [STYLE_INFO]    = ATTR(COLOR_GREEN, COLOR_DEFAULT, 0),
+    [STYLE_DEBUG]   = ATTR(COLOR_DEFAULT, COLOR_DEFAULT, ATTR_DIM),
+};
+
+Buffers buffers = {0}; // in argv order, each allocated on its own
 Buffer *current_b = NULL;
+Pager *current_p = NULL; // -R, no buffers then
+Clipboard clipboard = {0}; // shared by all buffers
+
+DA_Arena frame_arena = {0}; // temporaries of one main loop iteration
+
+Pool pool = {0};
+s32 wake_pipe[2] = {-1, -1}; // workers wake the main loop through this
 
 u16 term_width = 0;
 u16 term_height = 0;
 
+SB term_out = {0};  // escape sequences of the frame being rendered
+u64 term_bytes = 0; // written by term_flush so far
+bool headless = false;
+bool batch = false; // files are edited on the pool, nothing is profiled
+SB cache_dir = {0}; // --cache: line indexes are kept there, off if empty
+
+Profile profile = {0};
+const char *phase_names[PHASE_COUNT] = {
+    "read", "key", "lines", "diff", "output", "flush"
+};
+
 
 int main(int argc, char **argv)
 {
@@ -190,23 +1028,105 @@ int main(int argc, char **argv)
     assert(sizeof(s64) == 8);
 
     setlocale(LC_ALL, "en_US.utf-8");
-
-    if (argc != 2) {
-        printf("specify a file\n");
-        return 1;
+    da_arena_init(&frame_arena, FRAME_ARENA_SIZE);
+
+    const char *keys_path = NULL;
+    const char *profile_path = NULL;
+    bool follow = false;
+    bool read_only = false;
+    bool cache = false;
+    const char *script_path = NULL;
+
+    const char **paths = calloc(argc, sizeof(char *));
+    s32 paths_count = 0;
+
+    for (s32 i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            headless = true;
+            keys_path = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_path = argv[++i];
+        } else if (strcmp(argv[i], "--follow") == 0) {
+            follow = true;
+        } else if (strcmp(argv[i], "-R") == 0) {
+            read_only = true;
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            cache = true;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch = true;
+            script_path = argv[++i];
+        } else if (argv[i][0] == '-') {
+            paths_count = 0;
+            break;
+        } else {
+            paths[paths_count++] = argv[i];
+        }
     }
 
-    Buffer b = {0};
-    if (buffer_create_from_file(&b, argv[1]) == 0) {
-        printf("no file found\n");
+    if (paths_count == 0 || (read_only && paths_count > 1)) {
+        printf("usage: ted [--follow] [--cache] [--profile out.csv] file...\n"
+               "       ted -R file  (read-only pager for huge files)\n"
+               "       ted --bench keys [-R] file...  (replay keys headless)\n"
+               "       ted --batch script file...  (edit and save each file)\n");
         return 1;
     }
-    current_b = &b;
 
     cache_utf8_bytesize();
+    if (cache) cache_dir_open();
+
+    if (batch) {
+        headless = true;
+        term_width = BENCH_WIDTH;
+        term_height = BENCH_HEIGHT;
+
+        bool ok = batch_run(script_path, paths, paths_count);
+        pool_destroy(&pool);
+        da_arena_destroy(&frame_arena);
+        free(paths);
+        return ok ? 0 : 1;
+    }
+
+    u64 load_ns = time_ns();
+    buffers = Buffers_create();
+    Pager pager = {0};
+    if (read_only) {
+        if (!pager_open(&pager, paths[0])) {
+            printf("no file found: %s\n", paths[0]);
+            return 1;
+        }
+        current_p = &pager;
+    }
+    for (s32 i = 0; i < paths_count && !read_only; ++i) {
+        Buffer *b = malloc(sizeof(Buffer));
+        assert(b && "Buy more RAM");
+
+        if (buffer_create_from_file(b, paths[i]) == 0) {
+            printf("no file found: %s\n", paths[i]);
+            free(b);
+            return 1;
+        }
+        b->clipboard = &clipboard;
+        b->arena = &frame_arena;
+        Buffers_push_back(&buffers, b);
+    }
+    current_b = read_only ? NULL : buffers.data[0];
+
+    for (u32 i = 0; i < buffers.size && follow && !headless; ++i) {
+        Buffer *b = buffers.data[i];
+        if (!follow_start(b)) {
+            printf("can't follow %.*s\n", (s32)b->path.size, b->path.data);
+        }
+    }
+
+    buffers_trim(); // after follow_start, which needs lines and data
+    load_ns = time_ns() - load_ns;
 
-    char stdout_buf[1024 * 256] = {0};
-    setvbuf(stdout, stdout_buf, _IOFBF, 1024 * 256);
+    term_out = SB_create();
+
+    if (headless) {
+        bench_replay(keys_path, load_ns);
+        goto done;
+    }
 
     struct termios original_settings = {0};
     assert(tcgetattr(STDIN_FILENO, &original_settings) != -1);
@@ -239,193 +1159,77 @@ int main(int argc, char **argv)
     sa.sa_flags = SA_RESTART;
     sigaction(SIGWINCH, &sa, NULL);
 
+    assert(pipe(wake_pipe) == 0);
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
     printf("\033c"); // clear, scrollback included
 
     bool should_close = false;
+    bool redraw = true;
     while (!should_close) {
-        render(&b);
+        Buffer *b = current_b;
+
+        if (redraw) {
+            da_arena_reset(&frame_arena);
+            render_current();
+            profile_commit();
+        }
+        if (b) swap_flush(&b->swap, false); // idle until the next key anyway
+        redraw = true;
+
+        // inactive buffers catch up on their events in buffer_activate
+        struct pollfd fds[3] = {
+            { .fd = STDIN_FILENO, .events = POLLIN, .revents = 0 },
+            { .fd = wake_pipe[0], .events = POLLIN, .revents = 0 },
+            { .fd = b ? b->watch.fd : -1, .events = POLLIN, .revents = 0 }
+        };
+        if (poll(fds, 3, -1) < 0) continue; // SIGWINCH
+
+        // events for other files in the directory change nothing
+        redraw = false;
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0);
+            redraw = true;
+        }
+        if (fds[2].revents & POLLIN) {
+            redraw = watch_update(b) || redraw;
+        }
+        if (!(fds[0].revents & POLLIN)) continue;
+        redraw = true;
 
+        u64 t = time_ns();
         char c;
         if (read(STDIN_FILENO, &c, 1) != 1) break;
+        profile_add(PHASE_INPUT, t);
 
-        if (b.mode == NORMAL_MODE) {
-            switch (c) {
-            // basic commands
-            case 'q':
-                should_close = true;
-                break;
-            case 's':
-                buffer_save(&b);
-                break;
-            case 'y':
-                paste_clipboard_at_cursor(&b);
-                break;
-            case 'r':
-                clear_clipboard(&b);
-                break;
-
-            // enterning insert mode
-            case 'i':
-                b.mode = INSERT_MODE;
-                break;
-            case 'A':
-                move_line_end(&b);
-                b.mode = INSERT_MODE;
-                break;
-            case 'I':
-                move_line_begin(&b);
-                b.mode = INSERT_MODE;
-                break;
-            case 'o':
-                move_line_end(&b);
-                insert_char_at_cursor(&b, '\n');
-                b.mode = INSERT_MODE;
-                break;
-            case 'O':
-                move_up(&b);
-                move_line_end(&b);
-                insert_char_at_cursor(&b, '\n');
-                b.mode = INSERT_MODE;
-                break;
-
-            // entering region mode
-            case 'v':
-                b.mode = REGION_MODE;
-                begin_region(&b);
-                break;
-
-            // movement
-            case 'j':
-                move_down(&b);
-                break;
-            case 'k':
-                move_up(&b);
-                break;
-            case 'l':
-                move_right(&b);
-                break;
-            case 'h':
-                move_left(&b);
-                break;
-            case 'n':
-                move_down_page(&b);
-                center_cursor_line(&b);
-                break;
-            case 'p':
-                move_up_page(&b);
-                center_cursor_line(&b);
-                break;
-            case '0':
-                move_line_first_char(&b);
-                break;
-            case '^':
-                move_line_begin(&b);
-                break;
-            case '$':
-                move_line_end(&b);
-                break;
-            case 'g':
-                move_top(&b);
-                break;
-            case 'G':
-                move_bottom(&b);
-                break;
-
-            // screen operations
-            case 'f':
-                center_cursor_line(&b);
-                break;
-
-            // TODO skip rendering on 'default'
-            }
-        } else if (b.mode == REGION_MODE) {
-            switch (c) {
-            // basic commands
-            case 'v':
-                discard_region(&b);
-                b.mode = NORMAL_MODE;
-                break;
-            case 'c':
-                end_region(&b);
-                copy_region_append(&b);
-                b.mode = NORMAL_MODE;
-                break;
-            case 'x':
-                end_region(&b);
-                cut_region_append(&b);
-                b.mode = NORMAL_MODE;
-                break;
-            case 'd':
-                end_region(&b);
-                delete_region(&b);
-                b.mode = NORMAL_MODE;
-                break;
-            case 'r':
-                clear_clipboard(&b);
-                break;
-
-            // movement
-            case 'j':
-                move_down(&b);
-                break;
-            case 'k':
-                move_up(&b);
-                break;
-            case 'l':
-                move_right(&b);
-                break;
-            case 'h':
-                move_left(&b);
-                break;
-            case 'n':
-                move_down_page(&b);
-                center_cursor_line(&b);
-                break;
-            case 'p':
-                move_up_page(&b);
-                center_cursor_line(&b);
-                break;
-            case '0':
-                move_line_first_char(&b);
-                break;
-            case '^':
-                move_line_begin(&b);
-                break;
-            case '$':
-                move_line_end(&b);
-                break;
-            case 'g':
-                move_top(&b);
-                break;
-            case 'G':
-                move_bottom(&b);
-                break;
-
-            // screen operations
-            case 'f':
-                center_cursor_line(&b);
-                break;
-            }
-        } else if (b.mode == INSERT_MODE) {
-            switch (c) {
-            case 033:
-                b.mode = NORMAL_MODE;
-                break;
-            case 127: // backspace
-                backspace(&b);
-                break;
-            case '\t':
-                insert_indent_spaces_at_cursor(&b);
-                break;
-            default:
-                insert_char_at_cursor(&b, c);
-            }
-        }
+        t = time_ns();
+        if (!handle_key_current(c)) should_close = true;
+        profile_add(PHASE_DISPATCH, t);
     }
 
-    buffer_kill(&b);
     tcsetattr(STDIN_FILENO, TCSAFLUSH, &original_settings);
     printf("\033c"); // clear, scrollback included
+
+done:
+    if (profile_path && !profile_dump(profile_path)) {
+        printf("can't write %s\n", profile_path);
+    }
+
+    for (u32 i = 0; i < buffers.size; ++i) {
+        buffer_kill(buffers.data[i]);
+        free(buffers.data[i]);
+    }
+    Buffers_destroy(&buffers);
+    if (read_only) pager_close(&pager);
+    clipboard_destroy(&clipboard);
+    free(paths);
+
+    pool_destroy(&pool);
+    da_arena_destroy(&frame_arena);
+    SB_destroy(&term_out);
+    SB_destroy(&cache_dir);
     return 0;
 }
 
@@ -437,23 +1241,82 @@ static
 void term_clear(void)
 {
     for (u16 row_i = 0; row_i < term_height; ++row_i) {
-        for (u16 col_i = 0; col_i < term_width; ++col_i) {
-            TERM_SET_CHAR((Utf8_Char){ .abs = 0 }, row_i, col_i);
-        }
+        memset(frame_screen.glyphs[row_i], 0, sizeof(Utf8_Char) * term_width);
+        memset(frame_screen.attrs[row_i], 0, sizeof(u32) * term_width);
     }
 }
 
+// SGR parameters that take the terminal from attributes from to to, each
+// followed by ';'. Returns their length.
+static
+u32 sgr_params(char *out, u32 from, u32 to)
+{
+    u32 n = 0;
+    u8 old_flags = ATTR_FLAGS(from);
+    u8 new_flags = ATTR_FLAGS(to);
+    u8 removed = old_flags & ~new_flags;
+
+    if (removed & (ATTR_BOLD | ATTR_DIM)) { // 22 turns off both
+        n += sprintf(&out[n], "22;");
+        old_flags &= ~(ATTR_BOLD | ATTR_DIM);
+    }
+    if (removed & ATTR_UNDERLINE) n += sprintf(&out[n], "24;");
+    if (removed & ATTR_REVERSE)   n += sprintf(&out[n], "27;");
+
+    u8 added = new_flags & ~old_flags;
+    if (added & ATTR_BOLD)      n += sprintf(&out[n], "1;");
+    if (added & ATTR_DIM)       n += sprintf(&out[n], "2;");
+    if (added & ATTR_UNDERLINE) n += sprintf(&out[n], "4;");
+    if (added & ATTR_REVERSE)   n += sprintf(&out[n], "7;");
+
+    u8 fg = ATTR_FG(to);
+    if (fg != ATTR_FG(from)) {
+        n += sprintf(&out[n], "%u;", fg == 0 ? 39 : fg <= 8 ? 29 + fg : 81 + fg);
+    }
+
+    u8 bg = ATTR_BG(to);
+    if (bg != ATTR_BG(from)) {
+        n += sprintf(&out[n], "%u;", bg == 0 ? 49 : bg <= 8 ? 39 + bg : 91 + bg);
+    }
+
+    return n;
+}
+
+// Switches the terminal to attr with the shortest SGR sequence: only the
+// attributes that changed, or a reset followed by attr if that is shorter.
+static
+void term_set_attr(u32 attr)
+{
+    char delta[64];
+    char reset[64] = "0;";
+
+    u32 delta_len = sgr_params(delta, term_attr, attr);
+    u32 reset_len = 2 + sgr_params(&reset[2], 0, attr);
+
+    const char *params = delta_len <= reset_len ? delta : reset;
+    u32 len = MIN(delta_len, reset_len);
+
+    SB_push_back_many(&term_out, "\033[", 2);
+    SB_push_back_many(&term_out, params, len - 1); // without the last ';'
+    SB_push_back(&term_out, 'm');
+
+    term_attr = attr;
+}
+
 static
 void term_display(void)
 {
-    u16 row = 1;
+    u16 row = 0; // terminal cursor, 0 when unknown
+    u16 col = 0;
 
     for (u16 row_i = 0; row_i < term_height; ++row_i) {
-        u16 col = 1;
-        TERM_MOVE_CURSOR(row, col);
-
         for (u16 col_i = 0; col_i < term_width; ++col_i) {
-            if (!dirty_buffer[row_i][col_i]) continue;
+            Utf8_Char c = frame_screen.glyphs[row_i][col_i];
+            u32 attr = frame_screen.attrs[row_i][col_i];
+
+            if (!dirty_buffer[row_i][col_i] &&
+                display_screen.glyphs[row_i][col_i].abs == c.abs &&
+                display_screen.attrs[row_i][col_i] == attr) continue;
 
             if (row != row_i + 1 || col != col_i + 1) {
                 TERM_MOVE_CURSOR(row_i + 1, col_i + 1);
@@ -461,51 +1324,109 @@ void term_display(void)
                 col = col_i + 1;
             }
 
-            if (display_buffer[row_i][col_i].abs == 0)
-                putchar(' ');
+            if (attr != term_attr) term_set_attr(attr);
+
+            if (c.abs == 0)
+                SB_push_back(&term_out, ' ');
             else
-                printf("%s", display_buffer[row_i][col_i].arr);
+                SB_push_back_many(&term_out, c.arr, UTF8_BYTESIZE(c.arr[0]));
 
+            display_screen.glyphs[row_i][col_i] = c;
+            display_screen.attrs[row_i][col_i] = attr;
             dirty_buffer[row_i][col_i] = false;
             col++;
         }
-        row++;
     }
 }
 
 static
 void render(Buffer *b)
 {
+    u64 t = time_ns();
     term_clear();
 
     u16 cursor_visual_col = 1;
     u32 cursor_row = update_row_offset(b);
 
     Utf8_Char c = {0};
+    u8 styles[MAX_WIDTH * 4];
+
+    highlight_sync(b, b->row_offset + CONTENTS_HEIGHT);
+
+    u32 region_begin = 0;
+    u32 region_end = 0;
+    if (b->mode == REGION_MODE) {
+        region_begin = MIN(b->region_begin, b->cursor);
+        region_end = MAX(b->region_begin, b->cursor);
+    }
 
     for (u32 row_i = 0; row_i + 1 < term_height; ++row_i) {
         if (b->row_offset + row_i >= b->lines.size) {
             c.abs = 0;
             c.arr[0] = '~';
-            TERM_SET_CHAR(c, row_i, 0);
+            TERM_SET_CELL(c, 0, row_i, 0);
             continue;
         }
 
         Line line = Lines_at(&b->lines, b->row_offset + row_i);
+        bool line_ascii = bit_get(&b->ascii, b->row_offset + row_i);
+
+        // lines are cut at the right edge, only that part is highlighted
+        u32 visible = 0;
+        if (line_ascii) {
+            visible = MIN(line.end - line.begin, CONTENTS_WIDTH);
+        } else {
+            for (u16 col_i = 0;
+                 visible < line.end - line.begin && col_i < CONTENTS_WIDTH;
+                 ++col_i) {
+                visible += UTF8_BYTESIZE(SB_at(&b->data,
+                                               line.begin + visible));
+            }
+            visible = MIN(visible, line.end - line.begin);
+        }
+
+        memset(styles, STYLE_NORMAL, visible);
+        highlight_line(b->highlight.lang, &b->data.data[line.begin],
+                       line.end - line.begin, visible,
+                       highlight_state(&b->highlight, b->row_offset + row_i),
+                       styles);
+
+        u32 cursor_i = u32s_find(&b->cursors, line.begin);
         u16 col_i = 0;
+        for (u32 char_i = 0; char_i < visible;) {
+            u32 offset = line.begin + char_i;
+            u8 size = UTF8_BYTESIZE(SB_at(&b->data, offset));
 
-        for (u32 char_i = 0; char_i < line.end - line.begin;) {
-            u8 size = UTF8_BYTESIZE(SB_at(&b->data, line.begin + char_i));
+            u32 attr = style_attrs[styles[char_i]];
+            if (offset >= region_begin && offset < region_end) {
+                attr = ATTR_WITH_BG(attr, COLOR_BRIGHT_BLACK);
+            }
+            if (cursor_i < b->cursors.size &&
+                b->cursors.data[cursor_i] == offset) {
+                attr |= ATTR(0, 0, ATTR_REVERSE);
+                cursor_i++;
+            }
 
             c.abs = 0;
-            memcpy(c.arr, &b->data.data[line.begin + char_i], size);
-            TERM_SET_CHAR(c, row_i, col_i);
+            memcpy(c.arr, &b->data.data[offset], size);
+            TERM_SET_CELL(c, attr, row_i, col_i);
 
             col_i++;
             char_i += size;
         }
 
-        if (b->row_offset + row_i == cursor_row) {
+        // multi-cursor at the end of the line
+        if (cursor_i < b->cursors.size && col_i < CONTENTS_WIDTH &&
+            b->cursors.data[cursor_i] == line.end &&
+            visible == line.end - line.begin) {
+            c.abs = 0;
+            c.arr[0] = ' ';
+            TERM_SET_CELL(c, ATTR(0, 0, ATTR_REVERSE), row_i, col_i);
+        }
+
+        if (b->row_offset + row_i == cursor_row && line_ascii) {
+            cursor_visual_col += b->cursor - line.begin;
+        } else if (b->row_offset + row_i == cursor_row) {
             for (u32 k = line.begin; k < b->cursor;) {
                 cursor_visual_col++;
                 k += UTF8_BYTESIZE(SB_at(&b->data, k));
@@ -513,44 +1434,116 @@ void render(Buffer *b)
         }
     }
 
-    char status[TEMP_BUF_SIZE] = {0};
+    SB status = SB_create_with(&frame_arena.alloc);
+
+    if (profile.shown) {
+        profile_status(&status);
+        goto status_done;
+    }
+
+    if (b->mode == SEARCH_MODE) {
+        SB_push_back(&status, b->search.backward ? '?' : '/');
+        SB_push_back_many(&status, b->search.query.data, b->search.query.size);
+        if (b->search.regex) {
+            sb_appendf(&status, " [regex]");
+        }
+        if (b->search.error) {
+            sb_appendf(&status, " [%s]", b->search.error);
+        } else if (!b->search.found && b->search.query.size > 0) {
+            sb_appendf(&status, " [no match]");
+        }
+        goto status_done;
+    }
+
+    if (b->mode == GOTO_MODE) {
+        SB_push_back(&status, ':');
+        SB_push_back_many(&status, b->goto_input.data, b->goto_input.size);
+        goto status_done;
+    }
 
     if (!b->saved) {
-        strcat(status, "*");
+        SB_push_back(&status, '*');
     }
 
-    strncat(status, b->path.data, b->path.size);
-    sprintf(&status[strlen(status)], ":%u:%u",
-            cursor_row + 1, cursor_visual_col);
+    SB_push_back_many(&status, b->path.data, b->path.size);
+    sb_appendf(&status, ":%u:%u", cursor_row + 1, cursor_visual_col);
 
     if (b->mode == INSERT_MODE) {
-        strcat(status, " [insert]");
+        sb_appendf(&status, " [insert]");
+        if (b->cursors.size > 0) {
+            sb_appendf(&status, " [%lu cursors]", b->cursors.size);
+        }
     } else if (b->mode == REGION_MODE) {
-        strcat(status, " [region]");
+        sb_appendf(&status, " [region]");
+    }
+
+    if (b->follow.on) {
+        sb_appendf(&status, " [follow]");
+    }
+
+    if (b->watch.changed) {
+        sb_appendf(&status, " [changed on disk]");
+    }
+
+    const Count *count = &b->search.count;
+    if (count->running) {
+        sb_appendf(&status, " [counting]");
+    } else if (count->done) {
+        u32 i = count_find(count, b->cursor);
+        if (i < count->matches.size && count->matches.data[i] == b->cursor) {
+            sb_appendf(&status, " [%u/%lu]", i + 1, count->matches.size);
+        } else {
+            sb_appendf(&status, " [-/%lu]", count->matches.size);
+        }
+    }
+
+    if (buffers.size > 1) {
+        u32 i = 0;
+        while (buffers.data[i] != b) i++;
+        sb_appendf(&status, " [buffer %u/%lu]", i + 1, buffers.size);
     }
 
-    // TODO calculate length of clipboard
-    sprintf(&status[strlen(status)], " [%lu]", b->clipboard.size);
+    sb_appendf(&status, " [%lu]", b->clipboard->chars);
 
+status_done:;
     u16 col_i = 0;
 
-    for (u16 i = 0; i < strlen(status) && i < term_width;) {
-        u8 size = UTF8_BYTESIZE(status[i]);
+    for (u32 i = 0; i < status.size && col_i < term_width;) {
+        u8 size = UTF8_BYTESIZE(status.data[i]);
 
         c.abs = 0;
-        memcpy(c.arr, &status[i], size);
+        memcpy(c.arr, &status.data[i], size);
 
-        TERM_SET_CHAR(c, term_height - 1, col_i);
+        TERM_SET_CELL(c, 0, term_height - 1, col_i);
         i += size;
         col_i++;
     }
 
-    printf("\033[?25l"); // hide cursor
+    profile_add(PHASE_RENDER, t);
+
+    t = time_ns();
+    sb_appendf(&term_out, "\033[?25l"); // hide cursor
     term_display();
-    printf("\033[?25h"); // show cursor
+    sb_appendf(&term_out, "\033[?25h"); // show cursor
 
     TERM_MOVE_CURSOR(cursor_row - b->row_offset + 1, cursor_visual_col);
-    fflush(stdout);
+    profile_add(PHASE_DISPLAY, t);
+
+    term_flush();
+}
+
+// Writes out the frame built in term_out. Headless runs only count it.
+static
+void term_flush(void)
+{
+    u64 t = time_ns();
+    term_bytes += term_out.size;
+    if (!headless) {
+        fwrite(term_out.data, 1, term_out.size, stdout);
+        fflush(stdout);
+    }
+    term_out.size = 0;
+    profile_add(PHASE_FLUSH, t);
 }
 
 // #########################################################################
@@ -560,13 +1553,7 @@ void render(Buffer *b)
 static
 u32 get_cursor_row(Buffer *b)
 {
-    for (u32 i = 0; i < b->lines.size; ++i) {
-        Line line = Lines_at(&b->lines, i);
-        if (b->cursor >= line.begin && b->cursor <= line.end) {
-            return i;
-        }
-    }
-    assert(0 && "unreachable");
+    return lines_find_row(&b->lines, b->cursor);
 }
 
 static
@@ -590,6 +1577,11 @@ u32 update_last_visual_col(Buffer *b)
     u32 cursor_row = get_cursor_row(b);
     Line cursor_line = Lines_at(&b->lines, cursor_row);
 
+    if (bit_get(&b->ascii, cursor_row)) {
+        b->last_visual_col = b->cursor - cursor_line.begin;
+        return cursor_row;
+    }
+
     b->last_visual_col = 0;
     for (u32 i = cursor_line.begin; i < b->cursor; ) {
         b->last_visual_col++;
@@ -602,431 +1594,5564 @@ u32 update_last_visual_col(Buffer *b)
 static
 void set_cursor_col_after_vertical_move(Buffer *b, Line next_line)
 {
-    u32 next_line_visual_len = 0;
-    for (u32 i = next_line.begin; i < next_line.end; ) {
-        next_line_visual_len += 1;
-        i += UTF8_BYTESIZE(SB_at(&b->data, i));
+    b->cursor = line_offset_at_visual_col(b, next_line, b->last_visual_col);
+}
+
+// Offset of the character at col in line, its end if the line is shorter.
+static
+u32 line_offset_at_visual_col(const Buffer *b, Line line, u32 col)
+{
+    if (bit_get(&b->ascii, lines_find_row(&b->lines, line.begin))) {
+        return line.begin + MIN(col, line.end - line.begin);
     }
 
-    if (b->last_visual_col > next_line_visual_len) {
-        b->cursor = next_line.end;
-    } else {
-        b->cursor = next_line.begin;
-        for (u32 i = 0; i < b->last_visual_col; ++i) {
-            b->cursor += UTF8_BYTESIZE(SB_at(&b->data, b->cursor));
-        }
+    u32 offset = line.begin;
+    for (u32 i = 0; i < col && offset < line.end; ++i) {
+        offset += UTF8_BYTESIZE(SB_at(&b->data, offset));
     }
+    return MIN(offset, line.end);
 }
 
-// #########################################################################
-// Misc functions
-// #########################################################################
-
+// Index of the first value at or after value in the sorted a.
 static
-void signal_handler(s32 signum)
+u32 u32s_find(const U32s *a, u32 value)
 {
-    if (signum == SIGWINCH) {
-        struct winsize ws;
-        ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws); // TODO check ioctl fail
-        term_width = ws.ws_col;
-        term_height = ws.ws_row;
+    u32 lo = 0;
+    u32 hi = a->size;
 
-        assert(current_b);
-        memset(dirty_buffer, 1, MAX_WIDTH * MAX_HEIGHT);
-        tokenize_lines(&current_b->lines, &current_b->data);
-        render(current_b);
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        if (a->data[mid] < value) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
+
+    return lo;
 }
 
 static
-void cache_utf8_bytesize(void)
+void sb_appendf(SB *sb, const char *fmt, ...)
 {
-    for (u32 i = 0; i < 256; ++i) {
-        if      (i <= 127)             utf8_bytesize_cache[i] =  1;
-        else if (i >= 128 && i <= 191) utf8_bytesize_cache[i] =  0;
-        else if (i >= 192 && i <= 223) utf8_bytesize_cache[i] =  2;
-        else if (i >= 224 && i <= 239) utf8_bytesize_cache[i] =  3;
-        else if (i >= 240 && i <= 247) utf8_bytesize_cache[i] =  4;
-        // > 247 should be handled in macro
-    }
+    char tmp[TEMP_BUF_SIZE];
+
+    va_list args;
+    va_start(args, fmt);
+    s32 n = vsnprintf(tmp, TEMP_BUF_SIZE, fmt, args);
+    va_end(args);
+
+    if (n > 0) SB_push_back_many(sb, tmp, MIN(n, TEMP_BUF_SIZE - 1));
 }
 
-// #########################################################################
-// Lines functions
-// #########################################################################
-
+// Characters are the bytes that aren't continuation bytes 10xxxxxx.
 static
-u32 tokenize_lines(Lines *lines, SB *sb)
+u64 count_utf8_chars(const char *s, u32 n)
 {
-    lines->size = 0;
+    u64 chars = 0;
+    u32 i = 0;
+
+#ifdef __SSE2__
+    const __m128i below = _mm_set1_epi8((char)0xc0); // -64, signed
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+        u32 mask = _mm_movemask_epi8(_mm_cmplt_epi8(v, below));
+        chars += 16 - __builtin_popcount(mask);
+    }
+#endif
 
-    Line line = {0};
+    for (; i < n; ++i) {
+        chars += ((u8)s[i] & 0xc0) != 0x80;
+    }
+    return chars;
+}
 
-    for (u32 i = 0; i < sb->size; ++i) {
-        if (SB_at(sb, i) == '\n') {
-            line.end = i;
-            Lines_push_back(lines, line);
-            line.begin = i + 1;
-            line.end = 0;
-        }
+// No byte has the high bit set, so every byte is a character. Checked 64
+// bytes at a time, long lines that aren't stop early.
+static
+bool is_ascii(const char *s, u32 n)
+{
+    u32 i = 0;
+
+#ifdef __SSE2__
+    for (; i + 64 <= n; i += 64) {
+        const __m128i *v = (const __m128i *)&s[i];
+        __m128i any = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128(&v[0]), _mm_loadu_si128(&v[1])),
+            _mm_or_si128(_mm_loadu_si128(&v[2]), _mm_loadu_si128(&v[3])));
+        if (_mm_movemask_epi8(any)) return false;
     }
-    line.end = sb->size;
-    Lines_push_back(lines, line);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+        if (_mm_movemask_epi8(v)) return false;
+    }
+#endif
 
-    Lines_shrink_to_fit(lines);
+    for (; i < n; ++i) {
+        if ((u8)s[i] & 0x80) return false;
+    }
+    return true;
+}
 
-    return lines->size;
+static
+bool goto_parse(const SB *input, Goto *g)
+{
+    g->value = 0;
+    g->unit = GOTO_LINE;
+
+    u32 i = 0;
+    for (; i < input->size && input->data[i] >= '0' && input->data[i] <= '9';
+         ++i) {
+        if (g->value > PAGER_UNKNOWN / 10 - 1) return false;
+        g->value = g->value * 10 + (input->data[i] - '0');
+    }
+    if (i == 0) return false;
+
+    if (i + 1 == input->size && input->data[i] == '%') {
+        g->unit = GOTO_PERCENT;
+        g->value = MIN(g->value, 100);
+        i++;
+    } else if (i + 1 == input->size && input->data[i] == 'b') {
+        g->unit = GOTO_BYTE;
+        i++;
+    }
+    return i == input->size;
 }
 
 // #########################################################################
-// Buffer functions
+// Misc functions
 // #########################################################################
 
 static
-u32 buffer_create_from_file(Buffer *b, const char *path)
+void signal_handler(s32 signum)
 {
-    memset(b, 0, sizeof(Buffer));
-
-    FILE *fp = fopen(path, "r");
-    if (fp == NULL) return 0;
-
-    fseek(fp, 0, SEEK_END);
-    u32 file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    SB_reserve_cap(&b->data, file_size);
-    fread(b->data.data, 1, file_size, fp);
-    b->data.size = file_size;
-
-    b->lines = Lines_create();
-    tokenize_lines(&b->lines, &b->data);
-
-    b->path = SB_create();
-    SB_push_back_many(&b->path, path, strlen(path));
-
-    b->clipboard = SB_create();
-
-    b->saved = true;
+    if (signum == SIGWINCH) {
+        struct winsize ws;
+        ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws); // TODO check ioctl fail
+        term_width = ws.ws_col;
+        term_height = ws.ws_row;
 
-    fclose(fp);
-    return b->lines.size;
+        memset(dirty_buffer, 1, MAX_WIDTH * MAX_HEIGHT);
+        if (current_b) {
+            Buffer *b = current_b;
+            tokenize_lines(&b->lines, &b->ascii, &b->data);
+        }
+        render_current();
+    }
 }
 
 static
-void buffer_save(Buffer *b)
+u64 time_ms(void)
 {
-    char path[TEMP_BUF_SIZE] = {0};
-    strncpy(path, b->path.data, b->path.size);
-
-    FILE *fp = fopen(path, "w");
-    assert(fp);
-
-    fwrite(b->data.data, 1, b->data.size, fp);
+    return time_ns() / 1000000;
+}
 
-    fclose(fp);
-    b->saved = true;
+static
+u64 time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
 }
 
 static
-void buffer_kill(Buffer *b)
+void cache_utf8_bytesize(void)
 {
-    SB_destroy(&b->data);
-    SB_destroy(&b->path);
-    SB_destroy(&b->clipboard);
-    Lines_destroy(&b->lines);
-    memset(b, 0, sizeof(Buffer));
+    for (u32 i = 0; i < 256; ++i) {
+        if      (i <= 127)             utf8_bytesize_cache[i] =  1;
+        else if (i >= 128 && i <= 191) utf8_bytesize_cache[i] =  0;
+        else if (i >= 192 && i <= 223) utf8_bytesize_cache[i] =  2;
+        else if (i >= 224 && i <= 239) utf8_bytesize_cache[i] =  3;
+        else if (i >= 240 && i <= 247) utf8_bytesize_cache[i] =  4;
+        // > 247 should be handled in macro
+    }
 }
 
 // #########################################################################
-// Editor functions
+// Profile functions
 // #########################################################################
 
 static
-void move_down(Buffer *b)
+u32 histogram_bucket(u32 ns)
 {
-    u32 cursor_row = get_cursor_row(b);
-    if (cursor_row + 1 == b->lines.size) return;
+    if (ns < 8) return ns;
 
-    Line next_line = Lines_at(&b->lines, cursor_row + 1);
-    set_cursor_col_after_vertical_move(b, next_line);
+    u32 e = 31 - __builtin_clz(ns);
+    return (e - 1) * 4 + ((ns >> (e - 2)) & 3);
 }
 
+// Middle of the bucket, in ns.
 static
-void move_up(Buffer *b)
+double histogram_bucket_ns(u32 bucket)
 {
-    u32 cursor_row = get_cursor_row(b);
-    if (cursor_row == 0) return;
+    if (bucket < 8) return bucket;
 
-    Line next_line = Lines_at(&b->lines, cursor_row - 1);
-    set_cursor_col_after_vertical_move(b, next_line);
+    u32 e = bucket / 4 + 1;
+    u64 low = (u64)(4 + bucket % 4) << (e - 2);
+    u64 high = (u64)(5 + bucket % 4) << (e - 2);
+    return (low + high) / 2.0;
 }
 
 static
-void move_right(Buffer *b)
+void histogram_add(Histogram *h, u32 ns)
 {
-    if (b->cursor == b->data.size) return;
-
-    b->cursor += UTF8_BYTESIZE(SB_at(&b->data, b->cursor));
-    update_last_visual_col(b);
+    h->counts[histogram_bucket(ns)] += 1;
+    h->samples += 1;
+    h->sum_ns += ns;
+    h->max_ns = MAX(h->max_ns, ns);
 }
 
+// max_ns is left as it was, use histogram_percentile(h, 1000) instead.
 static
-void move_left(Buffer *b)
+void histogram_remove(Histogram *h, u32 ns)
 {
-    if (b->cursor == 0) return;
-
-    b->cursor--;
-    while (UTF8_BYTESIZE(SB_at(&b->data, b->cursor)) == 0) {
-        b->cursor--;
-    }
-
-    update_last_visual_col(b);
+    h->counts[histogram_bucket(ns)] -= 1;
+    h->samples -= 1;
+    h->sum_ns -= ns;
 }
 
+// permille is 500 for the median, 990 for p99.
 static
-void move_down_page(Buffer *b)
+double histogram_percentile(const Histogram *h, u32 permille)
 {
-    u32 cursor_row = get_cursor_row(b);
+    if (h->samples == 0) return 0;
 
-    Line next_line = {0};
-    if (cursor_row + CONTENTS_HEIGHT / 2 >= b->lines.size) {
-        next_line = Lines_at(&b->lines, b->lines.size - 1);
-    } else {
-        next_line = Lines_at(&b->lines, cursor_row + CONTENTS_HEIGHT / 2);
+    u64 rank = (h->samples * permille + 999) / 1000 - 1;
+    u64 seen = 0;
+    for (u32 i = 0; i < PROFILE_BUCKETS; ++i) {
+        seen += h->counts[i];
+        if (seen > rank) return histogram_bucket_ns(i);
     }
-
-    set_cursor_col_after_vertical_move(b, next_line);
+    return h->max_ns;
 }
 
+// Adds the time since start_ns to the phase in the current frame.
 static
-void move_up_page(Buffer *b)
+void profile_add(Phase phase, u64 start_ns)
 {
-    u32 cursor_row = get_cursor_row(b);
-
-    Line next_line = {0};
-    if (cursor_row < CONTENTS_HEIGHT / 2) {
-        next_line = Lines_at(&b->lines, 0);
-    } else {
-        next_line = Lines_at(&b->lines, cursor_row - CONTENTS_HEIGHT / 2);
-    }
+    if (batch) return; // the pool's threads would race on it
 
-    set_cursor_col_after_vertical_move(b, next_line);
+    profile.frame_ns[phase] += time_ns() - start_ns;
+    profile.ran[phase] = true;
 }
 
+// Ends the frame: phases that ran go into the histograms.
 static
-void move_line_first_char(Buffer *b)
+void profile_commit(void)
 {
-    u32 cursor_row = get_cursor_row(b);
-    Line cursor_line = Lines_at(&b->lines, cursor_row);
+    for (u32 p = 0; p < PHASE_COUNT; ++p) {
+        profile.last_ns[p] = 0;
+        if (!profile.ran[p]) continue;
 
-    b->cursor = cursor_line.begin;
+        u32 ns = MIN(profile.frame_ns[p], NOT_FOUND);
+        u32 *slot = &profile.ring[p][profile.ring_pos[p]];
 
-    b->last_visual_col = 0;
-}
+        if (profile.recent[p].samples == PROFILE_WINDOW) {
+            histogram_remove(&profile.recent[p], *slot);
+        }
+        *slot = ns;
+        profile.ring_pos[p] = (profile.ring_pos[p] + 1) % PROFILE_WINDOW;
 
-static
-void move_line_begin(Buffer *b)
-{
-    u32 cursor_row = get_cursor_row(b);
-    Line cursor_line = Lines_at(&b->lines, cursor_row);
+        histogram_add(&profile.recent[p], ns);
+        histogram_add(&profile.all[p], ns);
 
-    b->cursor = cursor_line.begin;
-    while (SB_at(&b->data, b->cursor) == ' ') {
-        b->cursor += 1;
+        profile.last_ns[p] = ns;
+        profile.frame_ns[p] = 0;
+        profile.ran[p] = false;
     }
-
-    update_last_visual_col(b);
 }
 
+// Last frame and p99 of the recent frames per phase, in microseconds.
 static
-void move_line_end(Buffer *b)
+void profile_status(SB *status)
 {
-    u32 cursor_row = get_cursor_row(b);
-    Line cursor_line = Lines_at(&b->lines, cursor_row);
-
-    b->cursor = cursor_line.end;
-
-    update_last_visual_col(b);
+    sb_appendf(status, "us last/p99:");
+    for (u32 p = 0; p < PHASE_COUNT; ++p) {
+        sb_appendf(status, " %s %.0f/%.0f", phase_names[p],
+                   profile.last_ns[p] / 1000.0,
+                   histogram_percentile(&profile.recent[p], 990) / 1000.0);
+    }
 }
 
+// Writes whole session percentiles of each phase as CSV.
 static
-void move_top(Buffer *b)
+bool profile_dump(const char *path)
 {
-    b->cursor = 0;
-    b->last_visual_col = 0;
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) return false;
+
+    fprintf(fp, "phase,samples,mean_us,p50_us,p90_us,p99_us,max_us\n");
+
+    for (u32 p = 0; p < PHASE_COUNT; ++p) {
+        const Histogram *h = &profile.all[p];
+        fprintf(fp, "%s,%lu,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+                phase_names[p], h->samples,
+                h->samples ? h->sum_ns / 1000.0 / h->samples : 0.0,
+                histogram_percentile(h, 500) / 1000.0,
+                histogram_percentile(h, 900) / 1000.0,
+                histogram_percentile(h, 990) / 1000.0,
+                h->max_ns / 1000.0);
+    }
+
+    fclose(fp);
+    return true;
 }
 
+// #########################################################################
+// Lines functions
+// #########################################################################
+
 static
-void move_bottom(Buffer *b)
+u32 tokenize_lines(Lines *lines, U64s *ascii, SB *sb)
 {
-    Line bottom_line = Lines_at(&b->lines, b->lines.size - 1);
-    b->cursor = bottom_line.begin;
-    b->last_visual_col = 0;
+    u64 t = time_ns();
+    lines->size = 0;
+    lines_scan(lines, ascii, sb, 0, sb->size);
+    Lines_shrink_to_fit(lines);
+    U64s_shrink_to_fit(ascii);
+
+    profile_add(PHASE_TOKENIZE, t);
+    return lines->size;
 }
 
+// Appends the lines of data[begin, end), where begin starts a line and
+// end ends one, and their bits to ascii. Newlines and bytes above 0x7f are
+// found in one pass.
 static
-void center_cursor_line(Buffer *b)
+void lines_scan(Lines    *lines,
+                U64s     *ascii,
+                const SB *sb,
+                u32       begin,
+                u32       end)
 {
-    u32 cursor_row = get_cursor_row(b);
+    const char *d = sb->data;
+    Line line = { .begin = begin };
+    bool line_ascii = true;
+    u32 i = begin;
+
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= end; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&d[i]);
+        u32 newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+        u32 high = _mm_movemask_epi8(v);
+
+        while (newlines) {
+            u32 k = __builtin_ctz(newlines);
+            line.end = i + k;
+            line_ascii = line_ascii && (high & ((1u << k) - 1)) == 0;
+            Lines_push_back(lines, line);
+            bit_set(ascii, lines->size - 1, line_ascii);
 
-    if (cursor_row <= CONTENTS_HEIGHT / 2) {
-        b->row_offset = 0;
-    } else {
-        b->row_offset = cursor_row - CONTENTS_HEIGHT / 2;
+            line.begin = line.end + 1;
+            line_ascii = true;
+            high &= ~0u << k; // the bytes before belong to that line
+            newlines &= newlines - 1;
+        }
+        line_ascii = line_ascii && high == 0;
+    }
+#endif
+
+    for (; i < end; ++i) {
+        if (d[i] == '\n') {
+            line.end = i;
+            Lines_push_back(lines, line);
+            bit_set(ascii, lines->size - 1, line_ascii);
+            line.begin = i + 1;
+            line_ascii = true;
+        } else if ((u8)d[i] & 0x80) {
+            line_ascii = false;
+        }
     }
+    line.end = end;
+    Lines_push_back(lines, line);
+    bit_set(ascii, lines->size - 1, line_ascii);
 }
 
+// Follows an edit of sb that took removed newlines out of row and the
+// lines after it and put added in: those lines are scanned again, the
+// ones after them only move. Costs the lines, not the bytes, of sb.
 static
-void insert_char_at_cursor(Buffer *b, char c)
+void lines_edit(Lines     *lines,
+                U64s      *ascii,
+                const SB  *sb,
+                u32        row,
+                u32        removed,
+                u32        added,
+                u32        del_len,
+                u32        ins_len)
 {
-    static u8 size = 0;
-    static u8 accum = 0;
-    static char buf[4] = {0};
+    u64 t = time_ns();
+    u32 delta = ins_len - del_len; // wraps around when bytes went away
 
-    if (UTF8_BYTESIZE(c) > 0) {
-        size = UTF8_BYTESIZE(c);
-        accum = 0;
-        memset(buf, 0, 4);
-    }
+    u32 begin = lines->data[row].begin;
+    u32 end = lines->data[row + removed].end + delta;
 
-    buf[accum++] = c;
+    for (u32 i = row + removed + 1; i < lines->size; ++i) {
+        lines->data[i].begin += delta;
+        lines->data[i].end += delta;
+    }
 
-    if (accum == size && accum != 0) {
-        SB_push_many(&b->data, b->cursor, buf, size);
+    Lines fresh = Lines_create();
+    U64s fresh_ascii = U64s_create();
+    lines_scan(&fresh, &fresh_ascii, sb, begin, end);
+    assert(fresh.size == added + 1);
 
-        b->cursor += size;
+    if (removed != added) {
+        u32 after = row + removed + 1; // the first line that only moved
+        u32 moved = lines->size - after;
 
-        if (buf[0] == '\n') {
-            b->last_visual_col = 0;
-        } else {
-            b->last_visual_col += 1;
-        }
+        Lines_delete_many(lines, row, removed + 1);
+        Lines_push_many(lines, row, fresh.data, fresh.size);
 
-        b->saved = false;
-        tokenize_lines(&b->lines, &b->data);
-        update_last_visual_col(b);
+        bits_fit(ascii, lines->size);
+        bits_move(ascii, row + added + 1, after, moved);
+    } else {
+        memcpy(&lines->data[row], fresh.data, fresh.size * sizeof(Line));
     }
+    for (u32 i = 0; i < fresh.size; ++i) {
+        bit_set(ascii, row + i, bit_get(&fresh_ascii, i));
+    }
+    Lines_destroy(&fresh);
+    U64s_destroy(&fresh_ascii);
+
+    profile_add(PHASE_TOKENIZE, t);
 }
 
+// Lines are contiguous, so the row of an offset is the last line that
+// begins at or before it.
 static
-void insert_indent_spaces_at_cursor(Buffer *b)
+u32 lines_find_row(const Lines *lines, u32 offset)
 {
-    const char buf[9] = "        "; // 8 spaces maximum
-    SB_push_many(&b->data, b->cursor, buf, INDENT_SPACES);
-    b->cursor += INDENT_SPACES;
+    assert(lines->size > 0);
+    assert(offset <= lines->data[lines->size - 1].end);
 
-    tokenize_lines(&b->lines, &b->data);
-    update_last_visual_col(b);
-    b->saved = false;
+    u32 lo = 0;
+    u32 hi = lines->size - 1;
+
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo + 1) / 2;
+        if (lines->data[mid].begin <= offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return lo;
 }
 
+// Extends lines over the bytes sb got past from, the last line goes on.
 static
-void backspace(Buffer *b)
+void lines_append(Lines    *lines,
+                  U64s     *ascii,
+                  const SB *sb,
+                  u32       from)
 {
-    if (b->cursor == 0) return;
-
-    b->cursor--;
-    while (UTF8_BYTESIZE(SB_at(&b->data, b->cursor)) == 0) {
-        b->cursor--;
+    u64 t = time_ns();
+    const char *p = &sb->data[from];
+    const char *end = &sb->data[sb->size];
+
+    u32 at = from; // the last line is checked up to here
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+        u32 i = p - sb->data;
+        u32 last = lines->size - 1;
+        lines->data[last].end = i;
+        bit_set(ascii, last,
+                bit_get(ascii, last) && is_ascii(&sb->data[at], i - at));
+        Lines_push_back(lines, (Line){ .begin = i + 1 });
+        bit_set(ascii, last + 1, true);
+        at = i + 1;
+        p++;
     }
+    u32 last = lines->size - 1;
+    lines->data[last].end = sb->size;
+    bit_set(ascii, last,
+            bit_get(ascii, last) && is_ascii(&sb->data[at], sb->size - at));
 
-    u8 size = UTF8_BYTESIZE(SB_at(&b->data, b->cursor));
-    SB_delete_many(&b->data, b->cursor, size);
-
-    b->saved = false;
-    tokenize_lines(&b->lines, &b->data);
-    update_last_visual_col(b);
+    profile_add(PHASE_TOKENIZE, t);
 }
 
+// Bit i of a bitset, as the lines' ascii bits are kept. A bitset has a
+// word past its last bit, so 64 bits can be read from any of them.
 static
-void begin_region(Buffer *b)
+bool bit_get(const U64s *bits, u32 i)
 {
-    b->region_begin = b->region_end = b->cursor;
+    return bits->data[i / 64] >> (i % 64) & 1;
 }
 
+// Makes room for count bits.
 static
-void end_region(Buffer *b)
+void bits_fit(U64s *bits, u32 count)
 {
-    if (b->cursor < b->region_begin) {
-        b->region_end = b->region_begin;
-        b->region_begin = b->cursor;
-    } else if (b->cursor > b->region_begin) {
-        b->region_end = b->cursor;
-    } else {
-        discard_region(b);
-    }
+    while (bits->size < count / 64 + 2) U64s_push_back(bits, 0);
 }
 
 static
-void discard_region(Buffer *b)
+void bit_set(U64s *bits, u32 i, bool on)
 {
-    b->region_begin = b->region_end = 0;
+    bits_fit(bits, i + 1);
+
+    u64 mask = 1ull << (i % 64);
+    if (on) bits->data[i / 64] |= mask;
+    else bits->data[i / 64] &= ~mask;
 }
 
+// The 64 bits from bit i on.
 static
-void copy_region_append(Buffer *b)
+u64 bits_read(const U64s *bits, u32 i)
 {
-    if (b->region_begin == b->region_end) return;
-    assert(b->region_end > b->region_begin);
+    u32 word = i / 64;
+    u32 shift = i % 64;
 
-    SB_push_back_many(&b->clipboard,
-                        &b->data.data[b->region_begin],
-                        b->region_end - b->region_begin);
+    u64 v = bits->data[word] >> shift;
+    if (shift > 0) v |= bits->data[word + 1] << (64 - shift);
+    return v;
 }
 
+// Puts the low n bits of v, 0 < n <= 64, at bit i.
 static
-void cut_region_append(Buffer *b)
+void bits_write(U64s *bits, u32 i, u64 v, u32 n)
 {
-    if (b->region_begin == b->region_end) return;
-    assert(b->region_end > b->region_begin);
-
-    SB_push_back_many(&b->clipboard,
-                        &b->data.data[b->region_begin],
-                        b->region_end - b->region_begin);
-    SB_delete_many(&b->data,
-                     b->region_begin,
-                     b->region_end - b->region_begin);
-
-    b->cursor = b->region_begin;
-    tokenize_lines(&b->lines, &b->data);
-    update_last_visual_col(b);
-    b->saved = false;
+    u32 word = i / 64;
+    u32 shift = i % 64;
+    u64 mask = n == 64 ? ~0ull : (1ull << n) - 1;
+    v &= mask;
+
+    bits->data[word] = (bits->data[word] & ~(mask << shift)) | v << shift;
+    if (shift + n > 64) {
+        u64 *next = &bits->data[word + 1];
+        *next = (*next & ~(mask >> (64 - shift))) | v >> (64 - shift);
+    }
 }
 
+// memmove of n bits, a word at a time. Both ranges must be set already.
 static
-void delete_region(Buffer *b)
+void bits_move(U64s *bits, u32 to, u32 from, u32 n)
 {
-    if (b->region_begin == b->region_end) return;
-    assert(b->region_end > b->region_begin);
+    if (to < from) {
+        for (u32 k = 0; k < n; k += 64) {
+            bits_write(bits, to + k, bits_read(bits, from + k), MIN(n - k, 64));
+        }
+    } else if (to > from) {
+        for (u32 k = n; k > 0;) {
+            u32 m = MIN(k, 64);
+            k -= m;
+            bits_write(bits, to + k, bits_read(bits, from + k), m);
+        }
+    }
+}
 
-    SB_delete_many(&b->data,
-                     b->region_begin,
+static
+u32 count_newlines(const char *s, u32 n)
+{
+    u32 count = 0;
+    const char *end = s + n;
+
+    while (s < end && (s = memchr(s, '\n', end - s)) != NULL) {
+        count++;
+        s++;
+    }
+    return count;
+}
+
+// #########################################################################
+// Search functions
+// #########################################################################
+
+// Returns the offset of the first occurrence of needle in hay or NOT_FOUND.
+// Candidates are filtered 16 at a time by comparing the first and last
+// needle bytes, only those are verified with memcmp.
+static
+u32 find_forward(const char *hay, u32 n, const char *needle, u32 m)
+{
+    if (m == 0) return 0;
+    if (m > n) return NOT_FOUND;
+
+    u32 last = n - m; // last possible start
+    u32 i = 0;
+
+#ifdef __SSE2__
+    const __m128i first_b = _mm_set1_epi8(needle[0]);
+    const __m128i last_b = _mm_set1_epi8(needle[m - 1]);
+
+    for (; i + 15 <= last; i += 16) {
+        __m128i f = _mm_loadu_si128((const __m128i *)&hay[i]);
+        __m128i l = _mm_loadu_si128((const __m128i *)&hay[i + m - 1]);
+        u32 mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(f, first_b),
+                                                   _mm_cmpeq_epi8(l, last_b)));
+        while (mask) {
+            u32 k = i + __builtin_ctz(mask);
+            if (memcmp(&hay[k], needle, m) == 0) return k;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i <= last; ++i) {
+        const char *p = memchr(&hay[i], needle[0], last - i + 1);
+        if (p == NULL) break;
+
+        i = p - hay;
+        if (memcmp(&hay[i], needle, m) == 0) return i;
+    }
+
+    return NOT_FOUND;
+}
+
+// Same as find_forward but returns the last occurrence.
+static
+u32 find_backward(const char *hay, u32 n, const char *needle, u32 m)
+{
+    if (m == 0) return n;
+    if (m > n) return NOT_FOUND;
+
+    u32 end = n - m + 1; // starts left to check are [0, end)
+
+#ifdef __SSE2__
+    const __m128i first_b = _mm_set1_epi8(needle[0]);
+    const __m128i last_b = _mm_set1_epi8(needle[m - 1]);
+
+    while (end >= 16) {
+        u32 i = end - 16;
+        __m128i f = _mm_loadu_si128((const __m128i *)&hay[i]);
+        __m128i l = _mm_loadu_si128((const __m128i *)&hay[i + m - 1]);
+        u32 mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(f, first_b),
+                                                   _mm_cmpeq_epi8(l, last_b)));
+        while (mask) {
+            u32 bit = 31 - __builtin_clz(mask);
+            if (memcmp(&hay[i + bit], needle, m) == 0) return i + bit;
+            mask &= ~(1u << bit);
+        }
+        end = i;
+    }
+#endif
+
+    while (end > 0) {
+        end--;
+        if (hay[end] == needle[0] && memcmp(&hay[end], needle, m) == 0) {
+            return end;
+        }
+    }
+
+    return NOT_FOUND;
+}
+
+// Finds the query starting after from (before from when backward),
+// wrapping around the buffer ends.
+static
+u32 search_from(Buffer *b, u32 from, bool backward)
+{
+    if (b->search.regex) {
+        if (!b->search.compiled) return NOT_FOUND;
+
+        Re_Input in = { buffer_chunk, b, b->data.size };
+        u32 begin, end;
+
+        if (!backward) {
+            if (from < b->data.size &&
+                re_search(&b->search.cache, &in, from + 1, b->data.size,
+                          &begin, &end)) {
+                return begin;
+            }
+            if (re_search(&b->search.cache, &in, 0, from, &begin, &end)) {
+                return begin;
+            }
+            return NOT_FOUND;
+        }
+
+        u32 pos = search_regex_before(b, from);
+        if (pos != NOT_FOUND) return pos;
+        return search_regex_before(b, b->data.size + 1);
+    }
+
+    const char *q = b->search.query.data;
+    u32 m = b->search.query.size;
+    const char *data = b->data.data;
+    u32 n = b->data.size;
+
+    if (m == 0 || m > n) return NOT_FOUND;
+
+    u32 pos = NOT_FOUND;
+
+    if (!backward) {
+        u32 start = MIN(from + 1, n);
+        pos = find_forward(&data[start], n - start, q, m);
+        if (pos != NOT_FOUND) return start + pos;
+
+        return find_forward(data, MIN((u64)from + m, n), q, m);
+    }
+
+    if (from > 0) {
+        pos = find_backward(data, MIN((u64)from - 1 + m, n), q, m);
+        if (pos != NOT_FOUND) return pos;
+    }
+
+    return find_backward(data, n, q, m);
+}
+
+// Last regex match starting before the given offset. The DFA only runs
+// forward, so windows ending at before are tried, growing 4x each time.
+static
+u32 search_regex_before(Buffer *b, u32 before)
+{
+    if (before == 0) return NOT_FOUND;
+
+    Re_Input in = { buffer_chunk, b, b->data.size };
+    u32 window = 64 * 1024;
+
+    for (;;) {
+        u32 from = (before > window) ? before - window : 0;
+        u32 last = NOT_FOUND;
+        u32 begin, end;
+
+        while (from < before &&
+               re_search(&b->search.cache, &in, from, before - 1,
+                         &begin, &end)) {
+            last = begin;
+            from = (end > begin) ? end : begin + 1;
+        }
+
+        if (last != NOT_FOUND || before <= window) return last;
+        window = (window > NOT_FOUND / 4) ? NOT_FOUND : window * 4;
+    }
+}
+
+// Buffer storage is a single run for now.
+static
+u32 buffer_chunk(void *ctx, u32 offset, const char **data, u32 *begin)
+{
+    Buffer *b = ctx;
+    (void)offset;
+
+    *data = b->data.data;
+    *begin = 0;
+    return b->data.size;
+}
+
+static
+u32 count_chunk(void *ctx, u32 offset, const char **data, u32 *begin)
+{
+    Count *c = ctx;
+    (void)offset;
+
+    *data = c->data;
+    *begin = 0;
+    return c->size;
+}
+
+// The first match starting in [from, limit), cache is NULL for literal
+// search. *next is where a scan for the following match starts, so
+// matches don't overlap.
+static
+bool count_next(const Count *c,
+                Re_Cache    *cache,
+                u32          from,
+                u32          limit,
+                u32         *begin,
+                u32         *next)
+{
+    if (from >= limit) return false;
+
+    if (cache == NULL) {
+        u32 m = c->query_len;
+        u32 end = MIN((u64)limit + m - 1, c->size);
+
+        u32 k = find_forward(&c->data[from], end - from, c->query, m);
+        if (k == NOT_FOUND) return false;
+
+        *begin = from + k;
+        *next = *begin + m;
+        return true;
+    }
+
+    Re_Input in = { count_chunk, (void *)c, c->size };
+    u32 end;
+    if (!re_search(cache, &in, from, limit - 1, begin, &end)) return false;
+
+    *next = (end > *begin) ? end : *begin + 1;
+    return true;
+}
+
+// Collects the non-overlapping matches starting in the task range, as if
+// a scan started at its beginning. count_poll fixes up the ones after a
+// match of the previous range that reaches into it.
+static
+void count_task_run(void *arg)
+{
+    Count_Task *t = arg;
+    Count *c = t->count;
+
+    Re_Cache cache;
+    if (c->re) re_cache_create(&cache, c->re);
+
+    u32 begin, next;
+    for (u32 pos = t->begin;
+         count_next(c, c->re ? &cache : NULL, pos, t->end, &begin, &next);
+         pos = next) {
+        if (__atomic_load_n(&c->cancel, __ATOMIC_RELAXED)) break;
+
+        U32s_push_back(&t->matches, begin);
+        t->next = next;
+    }
+
+    if (c->re) re_cache_destroy(&cache);
+
+    if (__atomic_sub_fetch(&c->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+        ssize_t ignored = write(wake_pipe[1], "", 1);
+        (void)ignored;
+    }
+}
+
+static
+void count_free_tasks(Count *c)
+{
+    for (u32 i = 0; i < c->task_count; ++i) {
+        U32s_destroy(&c->tasks[i].matches);
+    }
+    free(c->tasks);
+    c->tasks = NULL;
+    c->task_count = 0;
+}
+
+// Splits the buffer into COUNT_CHUNK_SIZE ranges and searches them on the
+// pool, the main loop is woken up when the last one finishes.
+static
+void count_start(Search *s, const SB *data)
+{
+    Count *c = &s->count;
+    count_cancel(c);
+
+    if (s->query.size == 0 || (s->regex && !s->compiled)) return;
+
+    if (pool.thread_count == 0) {
+        pool_create(&pool, sysconf(_SC_NPROCESSORS_ONLN));
+    }
+
+    c->data = data->data;
+    c->size = data->size;
+    c->query = s->query.data;
+    c->query_len = s->query.size;
+    c->re = s->regex ? &s->re : NULL;
+
+    c->task_count = MAX(1, (data->size + COUNT_CHUNK_SIZE - 1) /
+                           COUNT_CHUNK_SIZE);
+    c->tasks = calloc(c->task_count, sizeof(Count_Task));
+    assert(c->tasks && "Buy more RAM");
+
+    c->remaining = c->task_count;
+    c->cancel = 0;
+    c->running = true;
+    c->done = false;
+
+    for (u32 i = 0; i < c->task_count; ++i) {
+        Count_Task *t = &c->tasks[i];
+        t->count = c;
+        t->begin = i * COUNT_CHUNK_SIZE;
+        t->end = MIN((u64)t->begin + COUNT_CHUNK_SIZE, data->size);
+        t->next = t->begin;
+        t->matches = U32s_create();
+    }
+
+    for (u32 i = 0; i < c->task_count; ++i) {
+        pool_submit(&pool, count_task_run, &c->tasks[i]);
+    }
+}
+
+static
+void count_cancel(Count *c)
+{
+    if (c->running) {
+        __atomic_store_n(&c->cancel, 1, __ATOMIC_RELAXED);
+        pool_wait(&pool);
+        count_free_tasks(c);
+        c->running = false;
+    }
+
+    c->done = false;
+    U32s_destroy(&c->matches);
+}
+
+// Merges task results once all of them are done. Where the last match of
+// a range reaches into the next one, the scan goes on from its end until
+// it finds a match the next task found too, from there on they agree.
+static
+void count_poll(Count *c)
+{
+    if (!c->running) return;
+    if (__atomic_load_n(&c->remaining, __ATOMIC_ACQUIRE) != 0) return;
+
+    Re_Cache cache;
+    if (c->re) re_cache_create(&cache, c->re);
+
+    c->matches = U32s_create();
+    u32 pos = 0; // where the scan over the whole buffer would go on
+
+    for (u32 i = 0; i < c->task_count; ++i) {
+        Count_Task *t = &c->tasks[i];
+        u32 k = 0;
+        u32 begin, next;
+
+        while (pos > t->begin &&
+               count_next(c, c->re ? &cache : NULL, pos, t->end, &begin,
+                          &next)) {
+            while (k < t->matches.size && t->matches.data[k] < begin) k++;
+            if (k < t->matches.size && t->matches.data[k] == begin) break;
+
+            U32s_push_back(&c->matches, begin);
+            pos = next;
+        }
+
+        // inside a match of the scan, or the scan found none past them
+        while (k < t->matches.size && t->matches.data[k] < pos) k++;
+        if (k < t->matches.size) {
+            U32s_push_back_many(&c->matches, &t->matches.data[k],
+                                t->matches.size - k);
+            pos = t->next;
+        }
+        pos = MAX(pos, t->end);
+    }
+
+    if (c->re) re_cache_destroy(&cache);
+
+    count_free_tasks(c);
+    c->running = false;
+    c->done = true;
+}
+
+// Index of the first match at or after offset.
+static
+u32 count_find(const Count *c, u32 offset)
+{
+    return u32s_find(&c->matches, offset);
+}
+
+// Replaces every non-overlapping match, left to right, as one edit from
+// the first match to the end of the last, so it is undone in one step.
+// Returns the number of matches, NOT_FOUND if the regex doesn't compile.
+static
+u32 replace_all(Buffer     *b,
+                const char *pattern,
+                u32         pattern_len,
+                bool        regex,
+                const char *with,
+                u32         with_len)
+{
+    if (pattern_len == 0) return 0;
+
+    Re re = {0};
+    Re_Cache cache;
+    if (regex) {
+        if (re_compile(&re, pattern, pattern_len, &b->arena->alloc)) {
+            re_destroy(&re);
+            return NOT_FOUND;
+        }
+        re_cache_create(&cache, &re);
+    }
+
+    Re_Input in = { buffer_chunk, b, b->data.size };
+    SB out = SB_create();
+    u32 first = NOT_FOUND;
+    u32 copied = 0; // data before this is in out or replaced
+    u32 count = 0;
+
+    for (u32 pos = 0; pos <= b->data.size;) {
+        u32 begin, end;
+        if (regex) {
+            if (!re_search(&cache, &in, pos, b->data.size, &begin, &end)) break;
+        } else {
+            u32 i = find_forward(&b->data.data[pos], b->data.size - pos,
+                                 pattern, pattern_len);
+            if (i == NOT_FOUND) break;
+            begin = pos + i;
+            end = begin + pattern_len;
+        }
+
+        if (first == NOT_FOUND) first = copied = begin;
+        SB_push_back_many(&out, &b->data.data[copied], begin - copied);
+        SB_push_back_many(&out, with, with_len);
+        copied = end;
+        count++;
+
+        pos = end;
+        if (end == begin) { // empty match, step over a character
+            if (end == b->data.size) break;
+            u32 size = MAX(UTF8_BYTESIZE(b->data.data[end]), 1);
+            SB_push_back_many(&out, &b->data.data[end], size);
+            pos = copied = end + size;
+        }
+    }
+
+    if (count > 0) {
+        journal_seal(&b->journal);
+        journal_record(&b->journal, first, out.data, out.size,
+                       &b->data.data[first], copied - first);
+        buffer_apply(b, first, copied - first, out.data, out.size);
+        journal_seal(&b->journal);
+
+        b->cursor = MIN(b->cursor, b->data.size);
+        while (b->cursor > 0 && b->cursor < b->data.size &&
+               UTF8_BYTESIZE(SB_at(&b->data, b->cursor)) == 0) {
+            b->cursor--;
+        }
+    }
+
+    SB_destroy(&out);
+    if (regex) {
+        re_cache_destroy(&cache);
+        re_destroy(&re);
+    }
+    return count;
+}
+
+// #########################################################################
+// Highlight functions
+// #########################################################################
+
+typedef struct Hl_Word {
+    const char *word;
+    u8 style;
+} Hl_Word;
+
+static const Hl_Word hl_c_words[] = {
+    { "if", STYLE_KEYWORD }, { "else", STYLE_KEYWORD },
+    { "for", STYLE_KEYWORD }, { "while", STYLE_KEYWORD },
+    { "do", STYLE_KEYWORD }, { "switch", STYLE_KEYWORD },
+    { "case", STYLE_KEYWORD }, { "default", STYLE_KEYWORD },
+    { "break", STYLE_KEYWORD }, { "continue", STYLE_KEYWORD },
+    { "return", STYLE_KEYWORD }, { "goto", STYLE_KEYWORD },
+    { "sizeof", STYLE_KEYWORD }, { "typedef", STYLE_KEYWORD },
+    { "struct", STYLE_KEYWORD }, { "union", STYLE_KEYWORD },
+    { "enum", STYLE_KEYWORD }, { "static", STYLE_KEYWORD },
+    { "const", STYLE_KEYWORD }, { "extern", STYLE_KEYWORD },
+    { "volatile", STYLE_KEYWORD }, { "inline", STYLE_KEYWORD },
+    { "register", STYLE_KEYWORD }, { "restrict", STYLE_KEYWORD },
+    { "NULL", STYLE_NUMBER }, { "true", STYLE_NUMBER },
+    { "false", STYLE_NUMBER },
+    { "void", STYLE_TYPE }, { "char", STYLE_TYPE }, { "short", STYLE_TYPE },
+    { "int", STYLE_TYPE }, { "long", STYLE_TYPE }, { "float", STYLE_TYPE },
+    { "double", STYLE_TYPE }, { "signed", STYLE_TYPE },
+    { "unsigned", STYLE_TYPE }, { "bool", STYLE_TYPE },
+    { "size_t", STYLE_TYPE }, { "u8", STYLE_TYPE }, { "s8", STYLE_TYPE },
+    { "u16", STYLE_TYPE }, { "s16", STYLE_TYPE }, { "u32", STYLE_TYPE },
+    { "s32", STYLE_TYPE }, { "u64", STYLE_TYPE }, { "s64", STYLE_TYPE },
+};
+
+static const Hl_Word hl_log_words[] = {
+    { "FATAL", STYLE_ERROR }, { "ERROR", STYLE_ERROR },
+    { "ERR", STYLE_ERROR }, { "WARNING", STYLE_WARNING },
+    { "WARN", STYLE_WARNING }, { "INFO", STYLE_INFO },
+    { "DEBUG", STYLE_DEBUG }, { "TRACE", STYLE_DEBUG },
+};
+
+static
+bool hl_is_ident(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_';
+}
+
+static
+bool hl_is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// Styles [from, to) clipped to the visible part of the line.
+static
+void hl_mark(u8 *styles, u32 stop, u32 from, u32 to, u8 style)
+{
+    if (styles == NULL) return;
+    for (u32 i = from; i < to && i < stop; ++i) styles[i] = style;
+}
+
+static
+u8 hl_find_word(const Hl_Word *words, u32 count, const char *s, u32 n)
+{
+    for (u32 i = 0; i < count; ++i) {
+        if (strlen(words[i].word) == n && memcmp(words[i].word, s, n) == 0) {
+            return words[i].style;
+        }
+    }
+    return STYLE_NORMAL;
+}
+
+// End of the quoted string starting at i, past the closing quote.
+static
+u32 hl_skip_string(const char *s, u32 len, u32 i)
+{
+    char quote = s[i++];
+    while (i < len && s[i] != quote) {
+        if (s[i] == '\\') i++;
+        i++;
+    }
+    return MIN(i + 1, len);
+}
+
+static
+u8 highlight_c(const char *s, u32 len, u32 stop, u8 state, u8 *styles)
+{
+    u32 i = 0;
+    bool line_start = true; // only blanks so far, '#' starts a directive
+
+    if (state == HL_C_COMMENT) {
+        u32 end = find_forward(s, len, "*/", 2);
+        if (end == NOT_FOUND) {
+            hl_mark(styles, stop, 0, len, STYLE_COMMENT);
+            return HL_C_COMMENT;
+        }
+        i = end + 2;
+        hl_mark(styles, stop, 0, i, STYLE_COMMENT);
+    }
+
+    while (i < len) {
+        if (styles && i >= stop) return 0; // callers styling ignore state
+        char c = s[i];
+
+        if (c == '/' && i + 1 < len && s[i + 1] == '/') {
+            hl_mark(styles, stop, i, len, STYLE_COMMENT);
+            return 0;
+        }
+        if (c == '/' && i + 1 < len && s[i + 1] == '*') {
+            u32 end = find_forward(&s[i + 2], len - i - 2, "*/", 2);
+            if (end == NOT_FOUND) {
+                hl_mark(styles, stop, i, len, STYLE_COMMENT);
+                return HL_C_COMMENT;
+            }
+            hl_mark(styles, stop, i, i + end + 4, STYLE_COMMENT);
+            i += end + 4;
+            continue;
+        }
+
+        // the rest only matters for styles, comments are found above
+        if (styles == NULL) {
+            if (c == '"' || c == '\'') i = hl_skip_string(s, len, i);
+            else i++;
+            continue;
+        }
+
+        u32 begin = i;
+        if (c == '"' || c == '\'') {
+            i = hl_skip_string(s, len, i);
+            hl_mark(styles, stop, begin, i, STYLE_STRING);
+        } else if (c == '#' && line_start) {
+            i++;
+            while (i < len && (s[i] == ' ' || s[i] == '\t')) i++;
+            while (i < len && hl_is_ident(s[i])) i++;
+            hl_mark(styles, stop, begin, i, STYLE_PREPROC);
+        } else if (hl_is_digit(c)) {
+            while (i < len && (hl_is_ident(s[i]) || s[i] == '.')) i++;
+            hl_mark(styles, stop, begin, i, STYLE_NUMBER);
+        } else if (hl_is_ident(c)) {
+            while (i < len && hl_is_ident(s[i])) i++;
+            u8 style = hl_find_word(hl_c_words,
+                                    sizeof(hl_c_words) / sizeof(Hl_Word),
+                                    &s[begin], i - begin);
+            hl_mark(styles, stop, begin, i, style);
+        } else {
+            i++;
+        }
+
+        if (c != ' ' && c != '\t') line_start = false;
+    }
+
+    return 0;
+}
+
+static
+void highlight_json(const char *s, u32 len, u32 stop, u8 *styles)
+{
+    for (u32 i = 0; i < stop;) {
+        char c = s[i];
+        u32 begin = i;
+
+        if (c == '"') {
+            i = hl_skip_string(s, len, i);
+            u32 k = i;
+            while (k < len && (s[k] == ' ' || s[k] == '\t')) k++;
+            u8 style = k < len && s[k] == ':' ? STYLE_KEY : STYLE_STRING;
+            hl_mark(styles, stop, begin, i, style);
+        } else if (c == '-' || hl_is_digit(c)) {
+            i++;
+            while (i < len && (hl_is_digit(s[i]) || s[i] == '.' ||
+                               s[i] == 'e' || s[i] == 'E' ||
+                               s[i] == '+' || s[i] == '-')) i++;
+            hl_mark(styles, stop, begin, i, STYLE_NUMBER);
+        } else if (c >= 'a' && c <= 'z') {
+            while (i < len && s[i] >= 'a' && s[i] <= 'z') i++;
+            if ((i - begin == 4 && memcmp(&s[begin], "true", 4) == 0) ||
+                (i - begin == 5 && memcmp(&s[begin], "false", 5) == 0) ||
+                (i - begin == 4 && memcmp(&s[begin], "null", 4) == 0)) {
+                hl_mark(styles, stop, begin, i, STYLE_KEYWORD);
+            }
+        } else {
+            i++;
+        }
+    }
+}
+
+// Dims the leading timestamp and colors the first log level word.
+static
+void highlight_log(const char *s, u32 len, u32 stop, u8 *styles)
+{
+    u32 i = 0;
+    if (len > 0 && hl_is_digit(s[0])) {
+        while (i < len && s[i] != '\0' &&
+               (hl_is_digit(s[i]) || strchr("-:./TZ ,+", s[i]))) i++;
+        while (i > 0 && s[i - 1] == ' ') i--;
+        hl_mark(styles, stop, 0, i, STYLE_COMMENT);
+    }
+
+    while (i < stop) {
+        if (!hl_is_ident(s[i])) {
+            i++;
+            continue;
+        }
+
+        u32 begin = i;
+        while (i < len && hl_is_ident(s[i])) i++;
+
+        u8 style = hl_find_word(hl_log_words,
+                                sizeof(hl_log_words) / sizeof(Hl_Word),
+                                &s[begin], i - begin);
+        if (style != STYLE_NORMAL) {
+            hl_mark(styles, stop, begin, i, style);
+            return;
+        }
+    }
+}
+
+// Highlights the first stop bytes of a line of len bytes into styles (if
+// not NULL) and returns the state at the end of the line.
+static
+u8 highlight_line(Lang        lang,
+                  const char *s,
+                  u32         len,
+                  u32         stop,
+                  u8          state,
+                  u8         *styles)
+{
+    switch (lang) {
+    case LANG_C:
+        return highlight_c(s, len, stop, state, styles);
+    case LANG_JSON:
+        if (styles) highlight_json(s, len, stop, styles);
+        return 0;
+    case LANG_LOG:
+        if (styles) highlight_log(s, len, stop, styles);
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+static
+void highlight_create(Highlight *h, const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    ext = ext ? ext + 1 : "";
+
+    if (strcmp(ext, "c") == 0 || strcmp(ext, "h") == 0) {
+        h->lang = LANG_C;
+    } else if (strcmp(ext, "json") == 0) {
+        h->lang = LANG_JSON;
+    } else if (strcmp(ext, "log") == 0) {
+        h->lang = LANG_LOG;
+    } else {
+        h->lang = LANG_NONE;
+    }
+
+    h->states = U8s_create();
+    U8s_push_back(&h->states, 0);
+    h->valid = 1;
+    h->damage_end = 0;
+}
+
+static
+void highlight_destroy(Highlight *h)
+{
+    U8s_destroy(&h->states);
+}
+
+// Forgets every line state but the first, for a buffer replaced as a whole.
+static
+void highlight_reset(Highlight *h)
+{
+    h->states.size = 1;
+    h->valid = 1;
+    h->damage_end = 0;
+}
+
+// Line row had removed line breaks taken out and added put in. States
+// past it are shifted to stay with their lines.
+static
+void highlight_edit(Highlight *h, u32 row, u32 removed, u32 added)
+{
+    if (h->lang != LANG_C) return;
+
+    u32 at = row + 1;
+    if (at < h->states.size) {
+        if (removed > added) {
+            U8s_delete_many(&h->states, at,
+                            MIN(removed - added, h->states.size - at));
+        } else if (added > removed) {
+            u8 zeros[TEMP_BUF_SIZE] = {0};
+            for (u32 n = added - removed; n > 0;) {
+                u32 k = MIN(n, TEMP_BUF_SIZE);
+                U8s_push_many(&h->states, at, zeros, k);
+                n -= k;
+            }
+        }
+    }
+
+    if (h->damage_end > row) {
+        s64 end = (s64)h->damage_end + added - removed;
+        h->damage_end = MAX((s64)row, end);
+    }
+    h->damage_end = MAX(h->damage_end, row + added + 1);
+    h->valid = MIN(h->valid, at);
+}
+
+// Makes the states of rows below until_row exact. Highlighting restarts
+// at the first changed row and stops as soon as it meets a state that
+// didn't change past the damage, so the cost is the edit plus the screen.
+static
+void highlight_sync(Buffer *b, u32 until_row)
+{
+    Highlight *h = &b->highlight;
+    if (h->lang != LANG_C) return;
+
+    until_row = MIN(until_row, b->lines.size);
+    if (h->states.size > b->lines.size) h->states.size = b->lines.size;
+    bool changed = false;
+
+    while (h->valid < until_row) {
+        u32 row = h->valid;
+        Line prev = b->lines.data[row - 1];
+        u8 state = highlight_line(h->lang, &b->data.data[prev.begin],
+                                  prev.end - prev.begin, 0,
+                                  h->states.data[row - 1], NULL);
+
+        if (row == h->states.size) {
+            U8s_push_back(&h->states, state);
+            h->valid++;
+            changed = false;
+            continue;
+        }
+
+        bool same = h->states.data[row] == state;
+        h->states.data[row] = state;
+        h->valid++;
+        changed = !same;
+
+        if (same && row >= h->damage_end) h->valid = h->states.size;
+    }
+
+    if (h->valid > h->damage_end) h->damage_end = 0;
+
+    // stopped while states still changed: the ones past valid follow from
+    // the old ones, so a row before valid can't vouch for them
+    if (changed && h->valid < h->states.size) {
+        h->damage_end = MAX(h->damage_end, h->valid);
+    }
+}
+
+static
+u8 highlight_state(const Highlight *h, u32 row)
+{
+    if (h->lang != LANG_C) return 0;
+    assert(row < h->valid);
+    return h->states.data[row];
+}
+
+// #########################################################################
+// Bracket functions
+// #########################################################################
+
+static
+bool bracket_opens(char c)
+{
+    return c == '(' || c == '[' || c == '{';
+}
+
+static
+bool bracket_pairs(char open, char close)
+{
+    return (open == '(' && close == ')') || (open == '[' && close == ']') ||
+           (open == '{' && close == '}');
+}
+
+// Offset and depth after the bracket of a slot out of the gap.
+static
+u32 bracket_offset(const Brackets *br, u32 i)
+{
+    if (i < br->gap_begin) return br->slots.data[i].offset;
+    return br->size - br->slots.data[i].offset;
+}
+
+static
+s32 bracket_depth(const Brackets *br, u32 i)
+{
+    if (i < br->gap_begin) return br->slots.data[i].depth;
+    return br->depth - br->slots.data[i].depth;
+}
+
+static
+bool bracket_in_gap(const Brackets *br, u32 i)
+{
+    return i >= br->gap_begin && i < br->gap_end;
+}
+
+// Slots next to slot i skipping the gap, NOT_FOUND past either end. The
+// previous slot of slots.size is the last one.
+static
+u32 bracket_next(const Brackets *br, u32 i)
+{
+    i = (i + 1 == br->gap_begin) ? br->gap_end : i + 1;
+    return i < br->slots.size ? i : NOT_FOUND;
+}
+
+static
+u32 bracket_prev(const Brackets *br, u32 i)
+{
+    if (i == br->gap_end) i = br->gap_begin;
+    return i > 0 ? i - 1 : NOT_FOUND;
+}
+
+// First slot with a bracket at or past offset, slots.size if none.
+static
+u32 bracket_find(const Brackets *br, u32 offset)
+{
+    u32 gap = br->gap_end - br->gap_begin;
+    u32 lo = 0;
+    u32 hi = br->slots.size - gap;
+
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        u32 i = mid < br->gap_begin ? mid : mid + gap;
+        if (bracket_offset(br, i) < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo < br->gap_begin ? lo : lo + gap;
+}
+
+// Recomputes the leaves over slots [from, to) and the nodes above them.
+static
+void brackets_update(Brackets *br, u32 from, u32 to)
+{
+    if (from >= to) return;
+
+    Bracket_Range *tree = br->tree.data;
+    u32 leaves = br->slots.size / BRACKET_BLOCK;
+    u32 first = leaves + from / BRACKET_BLOCK;
+    u32 last = leaves + (to - 1) / BRACKET_BLOCK;
+
+    for (u32 node = first; node <= last; ++node) {
+        Bracket_Range r = { .lo = INT_MAX, .hi = INT_MIN };
+        u32 begin = (node - leaves) * BRACKET_BLOCK;
+
+        for (u32 i = begin; i < begin + BRACKET_BLOCK; ++i) {
+            if (i < br->gap_begin) {
+                r.lo = MIN(r.lo, br->slots.data[i].depth);
+            } else if (i >= br->gap_end) {
+                r.hi = MAX(r.hi, br->slots.data[i].depth);
+            }
+        }
+        tree[node] = r;
+    }
+
+    for (first /= 2, last /= 2; first > 0; first /= 2, last /= 2) {
+        for (u32 node = first; node <= last; ++node) {
+            tree[node].lo = MIN(tree[2 * node].lo, tree[2 * node + 1].lo);
+            tree[node].hi = MAX(tree[2 * node].hi, tree[2 * node + 1].hi);
+        }
+    }
+}
+
+// Whether a slot below node has a depth of at most depth.
+static
+bool bracket_node_within(const Brackets *br, u32 node, s32 depth)
+{
+    Bracket_Range r = br->tree.data[node];
+    return r.lo <= depth || (s64)br->depth - r.hi <= depth;
+}
+
+// First slot from i on whose depth is at most depth, NOT_FOUND if none.
+// The rest of the block of i is looked at, then the tree finds the block.
+static
+u32 brackets_first_within(const Brackets *br, u32 i, s32 depth)
+{
+    if (i == NOT_FOUND) return NOT_FOUND;
+
+    u32 leaves = br->slots.size / BRACKET_BLOCK;
+    u32 end = (i / BRACKET_BLOCK + 1) * BRACKET_BLOCK;
+
+    for (; i < end; ++i) {
+        if (!bracket_in_gap(br, i) && bracket_depth(br, i) <= depth) return i;
+    }
+
+    u32 node = leaves + i / BRACKET_BLOCK - 1;
+    while (node > 1 &&
+           (node % 2 == 1 || !bracket_node_within(br, node + 1, depth))) {
+        node /= 2;
+    }
+    if (node <= 1) return NOT_FOUND;
+
+    node += 1;
+    while (node < leaves) {
+        node = bracket_node_within(br, 2 * node, depth) ? 2 * node
+                                                        : 2 * node + 1;
+    }
+
+    for (i = (node - leaves) * BRACKET_BLOCK;; ++i) {
+        assert(i < (node - leaves + 1) * BRACKET_BLOCK);
+        if (!bracket_in_gap(br, i) && bracket_depth(br, i) <= depth) return i;
+    }
+}
+
+// Last slot at or before i whose depth is at most depth, NOT_FOUND if none.
+static
+u32 brackets_last_within(const Brackets *br, u32 i, s32 depth)
+{
+    if (i == NOT_FOUND) return NOT_FOUND;
+
+    u32 leaves = br->slots.size / BRACKET_BLOCK;
+    u32 begin = i / BRACKET_BLOCK * BRACKET_BLOCK;
+
+    for (;; --i) {
+        if (!bracket_in_gap(br, i) && bracket_depth(br, i) <= depth) return i;
+        if (i == begin) break;
+    }
+
+    u32 node = leaves + begin / BRACKET_BLOCK;
+    while (node > 1 &&
+           (node % 2 == 0 || !bracket_node_within(br, node - 1, depth))) {
+        node /= 2;
+    }
+    if (node <= 1) return NOT_FOUND;
+
+    node -= 1;
+    while (node < leaves) {
+        node = bracket_node_within(br, 2 * node + 1, depth) ? 2 * node + 1
+                                                            : 2 * node;
+    }
+
+    for (i = (node - leaves + 1) * BRACKET_BLOCK - 1;; --i) {
+        assert(i >= (node - leaves) * BRACKET_BLOCK);
+        if (!bracket_in_gap(br, i) && bracket_depth(br, i) <= depth) return i;
+    }
+}
+
+// Doubles the slots, the brackets after the gap move to the new end.
+static
+void brackets_grow(Brackets *br)
+{
+    u32 cap = br->slots.size;
+    u32 new_cap = MAX(cap * 2, BRACKET_MIN_SLOTS);
+    u32 after = cap - br->gap_end;
+
+    Bracket_Slots_reserve_cap(&br->slots, new_cap);
+    memmove(&br->slots.data[new_cap - after], &br->slots.data[br->gap_end],
+            after * sizeof(Bracket));
+    br->slots.size = new_cap;
+    br->gap_end = new_cap - after;
+
+    u32 nodes = 2 * new_cap / BRACKET_BLOCK;
+    Bracket_Ranges_reserve_cap(&br->tree, nodes);
+    br->tree.size = nodes;
+    brackets_update(br, 0, new_cap);
+}
+
+// Puts the bracket at data[offset] at the start of the gap. The tree is
+// left to the caller.
+static
+void brackets_push(Brackets *br, const char *data, u32 offset)
+{
+    if (br->gap_begin == br->gap_end) brackets_grow(br);
+
+    u32 i = br->gap_begin++;
+    s32 step = bracket_opens(data[offset]) ? 1 : -1;
+    s32 before = i > 0 ? br->slots.data[i - 1].depth : 0;
+
+    br->slots.data[i] = (Bracket){ .offset = offset, .depth = before + step };
+    br->depth += step;
+}
+
+// Moves the gap to the first bracket at or past offset. Brackets change
+// sides with the same formula both ways.
+static
+void brackets_move_gap(Brackets *br, u32 offset)
+{
+    u32 old_begin = br->gap_begin;
+    u32 old_end = br->gap_end;
+    Bracket *slots = br->slots.data;
+
+    while (br->gap_begin > 0 && slots[br->gap_begin - 1].offset >= offset) {
+        Bracket x = slots[--br->gap_begin];
+        slots[--br->gap_end] = (Bracket){ .offset = br->size - x.offset,
+                                          .depth = br->depth - x.depth };
+    }
+    while (br->gap_end < br->slots.size &&
+           br->size - slots[br->gap_end].offset < offset) {
+        Bracket x = slots[br->gap_end++];
+        slots[br->gap_begin++] = (Bracket){ .offset = br->size - x.offset,
+                                            .depth = br->depth - x.depth };
+    }
+
+    brackets_update(br, MIN(old_begin, br->gap_begin),
+                    MAX(old_begin, br->gap_begin));
+    brackets_update(br, MIN(old_end, br->gap_end), MAX(old_end, br->gap_end));
+}
+
+// Skips the string starting at data[i]. Strings end with their line, like
+// in hl_skip_string.
+static
+u32 bracket_skip_string(const char *data, u32 i, u32 end)
+{
+    char quote = data[i++];
+    while (i < end && data[i] != quote && data[i] != '\n') {
+        if (data[i] == '\\' && i + 1 < end && data[i + 1] != '\n') i++;
+        i++;
+    }
+    return i < end && data[i] == quote ? i + 1 : i;
+}
+
+// Takes the brackets after the gap that are before offset out, the depth
+// change of the ones after each is what the depth at the end becomes.
+static
+void brackets_drop(Brackets *br, u32 offset)
+{
+    // compared as bytes to the end, an edit can leave the brackets it took
+    // out with offsets before the gap
+    while (br->gap_end < br->slots.size &&
+           br->slots.data[br->gap_end].offset > br->size - offset) {
+        s32 before = br->gap_begin > 0 ?
+                     br->slots.data[br->gap_begin - 1].depth : 0;
+        br->depth = before + br->slots.data[br->gap_end++].depth;
+    }
+}
+
+// Pushes the brackets of data[begin, end) that are outside the strings and
+// comments of lang, the way highlight_line sees them. begin is a line
+// start or follows a bracket, state is the highlight state there and the
+// one at end is returned. The brackets after the gap up to end go, unless
+// a bracket found at or past meet is one of them: from there on nothing
+// changed, so the scan stops and sets met.
+static
+u8 brackets_scan(Brackets   *br,
+                 Lang        lang,
+                 const char *data,
+                 u32         begin,
+                 u32         end,
+                 u8          state,
+                 u32         meet,
+                 bool       *met)
+{
+    const char *set = lang == LANG_C ? "()[]{}\"'/" :
+                      lang == LANG_JSON ? "()[]{}\"" : "()[]{}";
+    u32 set_len = strlen(set);
+    u32 i = begin;
+
+#ifdef __SSE2__
+    __m128i want[9];
+    for (u32 k = 0; k < set_len; ++k) want[k] = _mm_set1_epi8(set[k]);
+#endif
+
+    for (;;) {
+        if (state == HL_C_COMMENT) {
+            u32 k = find_forward(&data[i], end - i, "*/", 2);
+            if (k == NOT_FOUND) break;
+            i += k + 2;
+            state = 0;
+        }
+
+#ifdef __SSE2__
+        while (i + 16 <= end) {
+            __m128i v = _mm_loadu_si128((const __m128i *)&data[i]);
+            __m128i hits = _mm_cmpeq_epi8(v, want[0]);
+            for (u32 k = 1; k < set_len; ++k) {
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi8(v, want[k]));
+            }
+
+            u32 mask = _mm_movemask_epi8(hits);
+            if (mask) {
+                i += __builtin_ctz(mask);
+                break;
+            }
+            i += 16;
+        }
+#endif
+        while (i < end && memchr(set, data[i], set_len) == NULL) i++;
+        if (i == end) break;
+
+        char c = data[i];
+        if (c == '"' || c == '\'') {
+            i = bracket_skip_string(data, i, end);
+        } else if (c == '/' && i + 1 < end && data[i + 1] == '/') {
+            const char *newline = memchr(&data[i], '\n', end - i);
+            i = newline ? (u32)(newline - data) : end;
+        } else if (c == '/' && i + 1 < end && data[i + 1] == '*') {
+            i += 2;
+            state = HL_C_COMMENT;
+        } else if (c == '/') {
+            i++;
+        } else {
+            if (i >= meet) {
+                brackets_drop(br, i);
+                if (br->gap_end < br->slots.size &&
+                    br->size - br->slots.data[br->gap_end].offset == i) {
+                    *met = true;
+                    return 0;
+                }
+            }
+            brackets_push(br, data, i);
+            i++;
+        }
+    }
+
+    brackets_drop(br, end);
+    return state;
+}
+
+// Indexes the brackets of the whole buffer. Logs are left out, their
+// brackets don't nest, and so are --batch runs, which have no use for
+// them.
+static
+void brackets_build(Buffer *b)
+{
+    Brackets *br = &b->brackets;
+    if (batch || b->highlight.lang == LANG_LOG) return;
+    u64 t = time_ns();
+
+    br->gap_begin = 0;
+    br->gap_end = br->slots.size;
+    br->size = b->data.size;
+    br->depth = 0;
+    br->on = true;
+
+    bool met = false;
+    brackets_scan(br, b->highlight.lang, b->data.data, 0, b->data.size, 0,
+                  NOT_FOUND, &met);
+    brackets_update(br, 0, br->slots.size);
+
+    profile_add(PHASE_TOKENIZE, t);
+}
+
+static
+void brackets_destroy(Brackets *br)
+{
+    Bracket_Slots_destroy(&br->slots);
+    Bracket_Ranges_destroy(&br->tree);
+    memset(br, 0, sizeof(Brackets));
+}
+
+// ins_len bytes at offset replaced others, in lines row to row + added.
+// The scan starts after the last bracket before the edit, or at the start
+// of its line, and goes on until it meets a bracket the edit didn't move
+// or the line where a C comment is open again as it was before. The
+// highlight states past row are still the ones from before the edit, see
+// buffer_apply.
+static
+void brackets_edit(Buffer *b,
+                   u32     row,
+                   u32     added,
+                   u32     offset,
+                   u32     ins_len)
+{
+    Brackets *br = &b->brackets;
+    if (!br->on) return;
+    u64 t = time_ns();
+
+    const Highlight *h = &b->highlight;
+    const char *data = b->data.data;
+    Line line = b->lines.data[row];
+    u32 last = row + added;
+
+    // offsets after the gap are still relative to the old size here
+    brackets_move_gap(br, offset);
+    br->size = b->data.size;
+
+    u32 pushed = br->gap_begin;
+    u32 kept = br->slots.size - br->gap_end; // the same after growing
+
+    u32 begin = line.begin;
+    u8 state = h->lang == LANG_C ? highlight_state(h, row) : 0;
+    u8 old = 0; // where the line after the edit began before it
+    if (h->lang == LANG_C && last + 1 < h->states.size) {
+        old = h->states.data[last + 1];
+    }
+    if (pushed > 0 && br->slots.data[pushed - 1].offset >= line.begin) {
+        begin = br->slots.data[pushed - 1].offset + 1;
+        state = 0;
+    }
+
+    bool met = false;
+    brackets_drop(br, offset + ins_len); // those of the bytes taken out
+    state = brackets_scan(br, h->lang, data, begin, b->lines.data[last].end,
+                          state, offset + ins_len, &met);
+
+    for (u32 r = last + 1; r < b->lines.size && !met && state != old; ++r) {
+        line = b->lines.data[r];
+        old = highlight_line(h->lang, &data[line.begin], line.end - line.begin,
+                             0, old, NULL);
+        state = brackets_scan(br, h->lang, data, line.begin, line.end, state,
+                              line.begin, &met);
+    }
+
+    brackets_update(br, pushed, br->gap_begin);
+    brackets_update(br, br->slots.size - kept, br->gap_end);
+
+    profile_add(PHASE_TOKENIZE, t);
+}
+
+// The bracket matching the one in slot i, NOT_FOUND if it has none.
+static
+u32 bracket_partner(const Brackets *br, const char *data, u32 i)
+{
+    char c = data[bracket_offset(br, i)];
+    s32 depth = bracket_depth(br, i);
+    u32 j;
+
+    if (bracket_opens(c)) {
+        // the first bracket back at the depth before this one closes it
+        j = brackets_first_within(br, bracket_next(br, i), depth - 1);
+        if (j == NOT_FOUND) return NOT_FOUND;
+        if (!bracket_pairs(c, data[bracket_offset(br, j)])) return NOT_FOUND;
+    } else {
+        // the one after the last bracket at this depth opens it
+        u32 k = brackets_last_within(br, bracket_prev(br, i), depth);
+        if (k == NOT_FOUND && depth < 0) return NOT_FOUND;
+        j = k == NOT_FOUND ? bracket_find(br, 0) : bracket_next(br, k);
+        if (j == i) return NOT_FOUND;
+        if (!bracket_pairs(data[bracket_offset(br, j)], c)) return NOT_FOUND;
+    }
+
+    return j;
+}
+
+// Offset of the bracket matching the one at offset, NOT_FOUND if there is
+// none there or it has no match.
+static
+u32 brackets_match(const Buffer *b, u32 offset)
+{
+    const Brackets *br = &b->brackets;
+    if (!br->on) return NOT_FOUND;
+
+    u32 i = bracket_find(br, offset);
+    if (i == br->slots.size || bracket_offset(br, i) != offset) {
+        return NOT_FOUND;
+    }
+
+    u32 j = bracket_partner(br, b->data.data, i);
+    return j == NOT_FOUND ? NOT_FOUND : bracket_offset(br, j);
+}
+
+// End of the next block at the depth of offset, over the blocks inside
+// it, or of the block around offset if there is no next one. A bracket at
+// offset belongs to the level it opens or closes.
+static
+u32 brackets_next_block(const Buffer *b, u32 offset)
+{
+    const Brackets *br = &b->brackets;
+    if (!br->on) return NOT_FOUND;
+
+    const char *data = b->data.data;
+    u32 i = bracket_find(br, offset);
+    if (i == br->slots.size) return NOT_FOUND;
+
+    if (bracket_offset(br, i) == offset && !bracket_opens(data[offset])) {
+        i = bracket_next(br, i);
+        if (i == NOT_FOUND) return NOT_FOUND;
+    }
+    if (bracket_opens(data[bracket_offset(br, i)])) {
+        i = bracket_partner(br, data, i);
+        if (i == NOT_FOUND) return NOT_FOUND;
+    }
+
+    return bracket_offset(br, i);
+}
+
+// Start of the previous block at the depth of offset, or of the block
+// around offset if there is no previous one.
+static
+u32 brackets_prev_block(const Buffer *b, u32 offset)
+{
+    const Brackets *br = &b->brackets;
+    if (!br->on) return NOT_FOUND;
+
+    const char *data = b->data.data;
+    u32 i = bracket_prev(br, bracket_find(br, offset + 1));
+    if (i == NOT_FOUND) return NOT_FOUND;
+
+    if (bracket_offset(br, i) == offset && bracket_opens(data[offset])) {
+        i = bracket_prev(br, i);
+        if (i == NOT_FOUND) return NOT_FOUND;
+    }
+    if (!bracket_opens(data[bracket_offset(br, i)])) {
+        i = bracket_partner(br, data, i);
+        if (i == NOT_FOUND) return NOT_FOUND;
+    }
+
+    return bracket_offset(br, i);
+}
+
+// #########################################################################
+// Pool functions
+// #########################################################################
+
+static
+void *pool_worker(void *arg)
+{
+    Pool *p = arg;
+
+    pthread_mutex_lock(&p->mutex);
+    for (;;) {
+        while (!p->stop && p->head == p->queue.size) {
+            pthread_cond_wait(&p->has_work, &p->mutex);
+        }
+        if (p->stop) break;
+
+        Task task = p->queue.data[p->head++];
+        p->busy++;
+
+        pthread_mutex_unlock(&p->mutex);
+        task.fn(task.arg);
+        pthread_mutex_lock(&p->mutex);
+
+        p->busy--;
+        if (p->busy == 0 && p->head == p->queue.size) {
+            p->head = p->queue.size = 0;
+            pthread_cond_broadcast(&p->idle);
+        }
+    }
+    pthread_mutex_unlock(&p->mutex);
+
+    return NULL;
+}
+
+static
+void pool_create(Pool *p, u32 thread_count)
+{
+    memset(p, 0, sizeof(Pool));
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->has_work, NULL);
+    pthread_cond_init(&p->idle, NULL);
+    p->queue = Tasks_create();
+
+    // signals are handled by the main thread only
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    p->thread_count = MIN(MAX(thread_count, 1), POOL_MAX_THREADS);
+    for (u32 i = 0; i < p->thread_count; ++i) {
+        assert(pthread_create(&p->threads[i], NULL, pool_worker, p) == 0);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static
+void pool_destroy(Pool *p)
+{
+    if (p->thread_count == 0) return;
+
+    pthread_mutex_lock(&p->mutex);
+    p->stop = true;
+    pthread_cond_broadcast(&p->has_work);
+    pthread_mutex_unlock(&p->mutex);
+
+    for (u32 i = 0; i < p->thread_count; ++i) {
+        pthread_join(p->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->has_work);
+    pthread_cond_destroy(&p->idle);
+    Tasks_destroy(&p->queue);
+    memset(p, 0, sizeof(Pool));
+}
+
+static
+void pool_submit(Pool *p, Task_Fn fn, void *arg)
+{
+    Task task = { .fn = fn, .arg = arg };
+
+    pthread_mutex_lock(&p->mutex);
+    Tasks_push_back(&p->queue, task);
+    pthread_cond_signal(&p->has_work);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+// Blocks until every submitted task has finished.
+static
+void pool_wait(Pool *p)
+{
+    pthread_mutex_lock(&p->mutex);
+    while (p->busy > 0 || p->head < p->queue.size) {
+        pthread_cond_wait(&p->idle, &p->mutex);
+    }
+    pthread_mutex_unlock(&p->mutex);
+}
+
+// #########################################################################
+// Regex functions
+// #########################################################################
+
+// Supported syntax: literals, '.', [classes] with ranges and '^'
+// negation, \d \w \s \D \W \S, \n \t \r and escaped metacharacters,
+// groups, '|', greedy and lazy '*' '+' '?', '^' and '$' line anchors.
+// '.' and negated classes never match '\n'.
+//
+// The pattern is parsed into a tree and compiled to two Thompson NFA
+// programs, forward and reversed. A search runs the forward DFA once
+// from the start offset to find where the leftmost-first match ends,
+// then the reversed DFA backwards from there to find where it starts.
+// There is no backtracking, the cost is linear in the scanned bytes.
+
+typedef struct Re_Parser {
+    const char *p;
+    u32 len;
+    u32 pos;
+    Re *re;
+    Re_Nodes nodes;
+    const char *error;
+} Re_Parser;
+
+static
+void re_set_add(Re_Set *set, u8 c)
+{
+    set->bits[c >> 3] |= (u8)(1 << (c & 7));
+}
+
+static
+bool re_set_has(const Re_Set *set, u8 c)
+{
+    return (set->bits[c >> 3] >> (c & 7)) & 1;
+}
+
+static
+void re_set_invert(Re_Set *set)
+{
+    for (u32 i = 0; i < 32; ++i) set->bits[i] = ~set->bits[i];
+    set->bits['\n' >> 3] &= (u8)~(1 << ('\n' & 7));
+}
+
+// Adds the bytes of \d \w \s and their complements, false if e isn't a
+// class escape.
+static
+bool re_set_add_escape(Re_Set *set, char e)
+{
+    Re_Set tmp = {0};
+
+    switch (e | 0x20) {
+    case 'd':
+        for (u32 c = '0'; c <= '9'; ++c) re_set_add(&tmp, c);
+        break;
+    case 'w':
+        for (u32 c = 0; c < 128; ++c) {
+            if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+                (c >= 'A' && c <= 'Z') || c == '_') {
+                re_set_add(&tmp, c);
+            }
+        }
+        break;
+    case 's':
+        re_set_add(&tmp, ' ');
+        for (u32 c = '\t'; c <= '\r'; ++c) re_set_add(&tmp, c);
+        break;
+    default:
+        return false;
+    }
+
+    if (e >= 'A' && e <= 'Z') re_set_invert(&tmp);
+    for (u32 i = 0; i < 32; ++i) set->bits[i] |= tmp.bits[i];
+    return true;
+}
+
+static
+char re_escape_literal(char e)
+{
+    switch (e) {
+    case 'n': return '\n';
+    case 't': return '\t';
+    case 'r': return '\r';
+    default: return e;
+    }
+}
+
+static
+u32 re_node(Re_Parser *ps, u8 kind, u32 a, u32 b)
+{
+    Re_Node node = { .kind = kind, .lazy = false, .a = a, .b = b };
+    Re_Nodes_push_back(&ps->nodes, node);
+    return ps->nodes.size - 1;
+}
+
+static
+u32 re_node_set(Re_Parser *ps, Re_Set set)
+{
+    Re_Sets_push_back(&ps->re->sets, set);
+    return re_node(ps, RE_N_SET, ps->re->sets.size - 1, 0);
+}
+
+static u32 re_parse_alt(Re_Parser *ps);
+
+static
+u32 re_parse_class(Re_Parser *ps)
+{
+    Re_Set set = {0};
+    bool negate = false;
+
+    if (ps->pos < ps->len && ps->p[ps->pos] == '^') {
+        negate = true;
+        ps->pos++;
+    }
+
+    bool first = true;
+    while (ps->pos < ps->len && (ps->p[ps->pos] != ']' || first)) {
+        first = false;
+        u8 lo = ps->p[ps->pos++];
+
+        if (lo == '\\') {
+            if (ps->pos == ps->len) break;
+            char e = ps->p[ps->pos++];
+            if (re_set_add_escape(&set, e)) continue;
+            lo = re_escape_literal(e);
+        }
+
+        u8 hi = lo;
+        if (ps->pos + 1 < ps->len && ps->p[ps->pos] == '-' &&
+            ps->p[ps->pos + 1] != ']') {
+            hi = ps->p[ps->pos + 1];
+            ps->pos += 2;
+            if (hi == '\\' && ps->pos < ps->len) {
+                hi = re_escape_literal(ps->p[ps->pos++]);
+            }
+            if (hi < lo) {
+                ps->error = "bad class range";
+                return NOT_FOUND;
+            }
+        }
+
+        for (u32 c = lo; c <= hi; ++c) re_set_add(&set, c);
+    }
+
+    if (ps->pos == ps->len) {
+        ps->error = "missing ]";
+        return NOT_FOUND;
+    }
+    ps->pos++;
+
+    if (negate) re_set_invert(&set);
+    return re_node_set(ps, set);
+}
+
+static
+u32 re_parse_atom(Re_Parser *ps)
+{
+    char c = ps->p[ps->pos++];
+    Re_Set set = {0};
+
+    switch (c) {
+    case '(': {
+        if (ps->pos + 1 < ps->len && ps->p[ps->pos] == '?' &&
+            ps->p[ps->pos + 1] == ':') {
+            ps->pos += 2;
+        }
+
+        u32 n = re_parse_alt(ps);
+        if (n == NOT_FOUND) return NOT_FOUND;
+
+        if (ps->pos == ps->len || ps->p[ps->pos] != ')') {
+            ps->error = "missing )";
+            return NOT_FOUND;
+        }
+        ps->pos++;
+        return n;
+    }
+    case '[':
+        return re_parse_class(ps);
+    case '.':
+        re_set_invert(&set);
+        return re_node_set(ps, set);
+    case '^':
+        return re_node(ps, RE_N_BOL, 0, 0);
+    case '$':
+        return re_node(ps, RE_N_EOL, 0, 0);
+    case '*':
+    case '+':
+    case '?':
+        ps->error = "nothing to repeat";
+        return NOT_FOUND;
+    case '\\':
+        if (ps->pos == ps->len) {
+            ps->error = "trailing \\";
+            return NOT_FOUND;
+        }
+        c = ps->p[ps->pos++];
+        if (re_set_add_escape(&set, c)) return re_node_set(ps, set);
+        c = re_escape_literal(c);
+        break;
+    }
+
+    re_set_add(&set, c);
+    return re_node_set(ps, set);
+}
+
+static
+u32 re_parse_repeat(Re_Parser *ps)
+{
+    u32 n = re_parse_atom(ps);
+    if (n == NOT_FOUND) return NOT_FOUND;
+
+    while (ps->pos < ps->len) {
+        u8 kind;
+        switch (ps->p[ps->pos]) {
+        case '*': kind = RE_N_STAR; break;
+        case '+': kind = RE_N_PLUS; break;
+        case '?': kind = RE_N_QUEST; break;
+        default: return n;
+        }
+        ps->pos++;
+
+        n = re_node(ps, kind, n, 0);
+        if (ps->pos < ps->len && ps->p[ps->pos] == '?') {
+            ps->nodes.data[n].lazy = true;
+            ps->pos++;
+        }
+    }
+
+    return n;
+}
+
+static
+u32 re_parse_cat(Re_Parser *ps)
+{
+    u32 n = NOT_FOUND;
+
+    while (ps->pos < ps->len &&
+           ps->p[ps->pos] != '|' && ps->p[ps->pos] != ')') {
+        u32 r = re_parse_repeat(ps);
+        if (r == NOT_FOUND) return NOT_FOUND;
+
+        n = (n == NOT_FOUND) ? r : re_node(ps, RE_N_CAT, n, r);
+    }
+
+    return (n == NOT_FOUND) ? re_node(ps, RE_N_EMPTY, 0, 0) : n;
+}
+
+static
+u32 re_parse_alt(Re_Parser *ps)
+{
+    u32 n = re_parse_cat(ps);
+
+    while (n != NOT_FOUND && ps->pos < ps->len && ps->p[ps->pos] == '|') {
+        ps->pos++;
+        u32 r = re_parse_cat(ps);
+        if (r == NOT_FOUND) return NOT_FOUND;
+
+        n = re_node(ps, RE_N_ALT, n, r);
+    }
+
+    return n;
+}
+
+static
+void re_emit(Re_Insts *prog, const Re_Nodes *nodes, u32 n, bool reverse)
+{
+    Re_Node node = nodes->data[n];
+    Re_Inst inst = {0};
+    u32 at = prog->size;
+
+    switch (node.kind) {
+    case RE_N_SET:
+        inst.op = RE_BYTES;
+        inst.x = node.a;
+        Re_Insts_push_back(prog, inst);
+        break;
+    case RE_N_EMPTY:
+        break;
+    case RE_N_BOL:
+    case RE_N_EOL:
+        // in the reversed program the byte before is the byte after
+        inst.op = ((node.kind == RE_N_BOL) != reverse) ? RE_BOL : RE_EOL;
+        Re_Insts_push_back(prog, inst);
+        break;
+    case RE_N_CAT:
+        re_emit(prog, nodes, reverse ? node.b : node.a, reverse);
+        re_emit(prog, nodes, reverse ? node.a : node.b, reverse);
+        break;
+    case RE_N_ALT: {
+        inst.op = RE_SPLIT;
+        Re_Insts_push_back(prog, inst);
+        prog->data[at].x = prog->size;
+        re_emit(prog, nodes, node.a, reverse);
+
+        u32 jmp = prog->size;
+        inst.op = RE_JMP;
+        Re_Insts_push_back(prog, inst);
+        prog->data[at].y = prog->size;
+        re_emit(prog, nodes, node.b, reverse);
+        prog->data[jmp].x = prog->size;
+        break;
+    }
+    case RE_N_STAR:
+    case RE_N_QUEST: {
+        inst.op = RE_SPLIT;
+        Re_Insts_push_back(prog, inst);
+        re_emit(prog, nodes, node.a, reverse);
+
+        if (node.kind == RE_N_STAR) {
+            inst.op = RE_JMP;
+            inst.x = at;
+            Re_Insts_push_back(prog, inst);
+        }
+
+        u32 body = at + 1, out = prog->size;
+        prog->data[at].x = node.lazy ? out : body;
+        prog->data[at].y = node.lazy ? body : out;
+        break;
+    }
+    case RE_N_PLUS: {
+        re_emit(prog, nodes, node.a, reverse);
+
+        u32 out = prog->size + 1;
+        inst.op = RE_SPLIT;
+        inst.x = node.lazy ? out : at;
+        inst.y = node.lazy ? at : out;
+        Re_Insts_push_back(prog, inst);
+        break;
+    }
+    }
+}
+
+// Collects the single byte sets the pattern starts with into re->prefix.
+static
+void re_collect_prefix(Re *re, const Re_Nodes *nodes, u32 n, bool *stop)
+{
+    if (*stop) return;
+
+    Re_Node node = nodes->data[n];
+
+    switch (node.kind) {
+    case RE_N_CAT:
+        re_collect_prefix(re, nodes, node.a, stop);
+        re_collect_prefix(re, nodes, node.b, stop);
+        break;
+    case RE_N_EMPTY:
+    case RE_N_BOL:
+        break;
+    case RE_N_SET: {
+        const Re_Set *set = &re->sets.data[node.a];
+        u32 count = 0;
+        u8 byte = 0;
+
+        for (u32 c = 0; c < 256; ++c) {
+            if (re_set_has(set, c)) {
+                count++;
+                byte = c;
+            }
+        }
+
+        if (count == 1) {
+            SB_push_back(&re->prefix, byte);
+        } else {
+            *stop = true;
+        }
+        break;
+    }
+    default:
+        *stop = true;
+    }
+}
+
+// Returns NULL on success or a message describing the syntax error. The
+// parse tree is allocated with scratch.
+static
+const char *re_compile(Re           *re,
+                       const char   *pattern,
+                       u32           len,
+                       DA_Allocator *scratch)
+{
+    re->sets = Re_Sets_create();
+    re->fwd = Re_Insts_create();
+    re->rev = Re_Insts_create();
+    re->prefix = SB_create();
+
+    Re_Parser ps = {
+        .p = pattern,
+        .len = len,
+        .pos = 0,
+        .re = re,
+        .nodes = Re_Nodes_create_with(scratch),
+        .error = NULL
+    };
+
+    u32 root = re_parse_alt(&ps);
+    if (root != NOT_FOUND && ps.pos < ps.len) ps.error = "unmatched )";
+
+    if (ps.error == NULL) {
+        Re_Inst match = { .op = RE_MATCH, .x = 0, .y = 0 };
+
+        re_emit(&re->fwd, &ps.nodes, root, false);
+        Re_Insts_push_back(&re->fwd, match);
+        re_emit(&re->rev, &ps.nodes, root, true);
+        Re_Insts_push_back(&re->rev, match);
+
+        bool stop = false;
+        re_collect_prefix(re, &ps.nodes, root, &stop);
+    }
+
+    Re_Nodes_destroy(&ps.nodes);
+    return ps.error;
+}
+
+static
+void re_destroy(Re *re)
+{
+    Re_Sets_destroy(&re->sets);
+    Re_Insts_destroy(&re->fwd);
+    Re_Insts_destroy(&re->rev);
+    SB_destroy(&re->prefix);
+}
+
+static
+void re_dfa_flush(Re_Dfa *d)
+{
+    d->states.size = 0;
+    d->pcs.size = 0;
+    d->trans.size = 0;
+    memset(d->table.data, 0, sizeof(u32) * d->table.size);
+    d->start[0] = d->start[1] = RE_UNKNOWN;
+    d->flushes++;
+}
+
+static
+void re_dfa_create(Re_Dfa *d, const Re *re, const Re_Insts *prog,
+                   bool unanchored)
+{
+    memset(d, 0, sizeof(Re_Dfa));
+    d->re = re;
+    d->prog = prog;
+    d->unanchored = unanchored;
+
+    d->states = Re_States_create();
+    d->pcs = U32s_create();
+    d->trans = U32s_create();
+    d->list = U32s_create();
+    d->next = U32s_create();
+
+    d->table = U32s_create();
+    U32s_reserve_cap(&d->table, RE_MAX_STATES * 2);
+    d->table.size = RE_MAX_STATES * 2;
+
+    d->marks = U32s_create();
+    U32s_reserve_cap(&d->marks, prog->size + 1);
+    d->marks.size = prog->size + 1;
+    U32s_init_with_zeros(&d->marks);
+
+    re_dfa_flush(d);
+    d->flushes = 0;
+}
+
+static
+void re_dfa_destroy(Re_Dfa *d)
+{
+    Re_States_destroy(&d->states);
+    U32s_destroy(&d->pcs);
+    U32s_destroy(&d->trans);
+    U32s_destroy(&d->table);
+    U32s_destroy(&d->list);
+    U32s_destroy(&d->next);
+    U32s_destroy(&d->marks);
+}
+
+// Returns the state with the given flags and the thread list in d->next,
+// building it if needed. May flush the whole cache.
+static
+u32 re_dfa_intern(Re_Dfa *d, u32 flags)
+{
+    u32 hash = 2166136261u ^ flags;
+    for (u32 i = 0; i < d->next.size; ++i) {
+        hash = (hash ^ d->next.data[i]) * 16777619u;
+    }
+
+    u32 mask = d->table.size - 1;
+    u32 slot = hash & mask;
+
+    for (; d->table.data[slot] != 0; slot = (slot + 1) & mask) {
+        Re_State st = d->states.data[d->table.data[slot] - 1];
+        if (st.flags == flags && st.count == d->next.size &&
+            memcmp(&d->pcs.data[st.pcs], d->next.data,
+                   sizeof(u32) * st.count) == 0) {
+            return (d->table.data[slot] - 1) * RE_ROW;
+        }
+    }
+
+    if (d->states.size == RE_MAX_STATES) {
+        re_dfa_flush(d);
+        for (slot = hash & mask; d->table.data[slot] != 0;) {
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    Re_State st = { .pcs = d->pcs.size, .count = d->next.size, .flags = flags };
+    if (d->next.size > 0) {
+        U32s_push_back_many(&d->pcs, d->next.data, d->next.size);
+    }
+    Re_States_push_back(&d->states, st);
+
+    for (u32 i = 0; i < RE_ROW; ++i) U32s_push_back(&d->trans, RE_UNKNOWN);
+
+    d->table.data[slot] = d->states.size;
+    return (d->states.size - 1) * RE_ROW;
+}
+
+static
+void re_dfa_add(Re_Dfa *d, u32 pc, u32 flags, bool eol)
+{
+    if (d->marks.data[pc] == d->gen) return;
+    d->marks.data[pc] = d->gen;
+
+    Re_Inst inst = d->prog->data[pc];
+
+    switch (inst.op) {
+    case RE_JMP:
+        re_dfa_add(d, inst.x, flags, eol);
+        break;
+    case RE_SPLIT:
+        re_dfa_add(d, inst.x, flags, eol);
+        re_dfa_add(d, inst.y, flags, eol);
+        break;
+    case RE_BOL:
+        if (flags & RE_F_BOL) re_dfa_add(d, pc + 1, flags, eol);
+        break;
+    case RE_EOL:
+        if (eol) re_dfa_add(d, pc + 1, flags, eol);
+        break;
+    default:
+        U32s_push_back(&d->list, pc);
+    }
+}
+
+// Transition of state on byte c (256 for end of input). The result is
+// the next state id, with RE_MATCH_BIT set if a match ends before c and
+// RE_DEAD_BIT set if no match can follow.
+static
+u32 re_dfa_step(Re_Dfa *d, u32 state, u32 c)
+{
+    u32 cached = d->trans.data[state + c];
+    if (cached != RE_UNKNOWN) return cached;
+
+    Re_State st = d->states.data[state / RE_ROW];
+    bool eol = (c == 256 || c == '\n');
+
+    d->gen++;
+    d->list.size = 0;
+    for (u32 i = 0; i < st.count; ++i) {
+        re_dfa_add(d, d->pcs.data[st.pcs + i], st.flags, eol);
+    }
+
+    bool matched = false;
+    d->gen++;
+    d->next.size = 0;
+
+    for (u32 i = 0; i < d->list.size; ++i) {
+        u32 pc = d->list.data[i];
+        Re_Inst inst = d->prog->data[pc];
+
+        if (inst.op == RE_MATCH) {
+            matched = true;
+            if (d->unanchored) break; // lower priority threads lose
+            continue;
+        }
+
+        if (c < 256 && re_set_has(&d->re->sets.data[inst.x], c) &&
+            d->marks.data[pc + 1] != d->gen) {
+            d->marks.data[pc + 1] = d->gen;
+            U32s_push_back(&d->next, pc + 1);
+        }
+    }
+
+    if (c == 256) {
+        u32 result = matched ? RE_MATCH_BIT : 0;
+        d->trans.data[state + c] = result;
+        return result;
+    }
+
+    u32 flags = (c == '\n') ? RE_F_BOL : 0;
+    if (!d->unanchored || matched || (st.flags & RE_F_NORESTART)) {
+        flags |= RE_F_NORESTART;
+    } else if (d->marks.data[0] != d->gen) {
+        U32s_push_back(&d->next, 0);
+    }
+
+    u32 flushes = d->flushes;
+    u32 result = re_dfa_intern(d, flags) | (matched ? RE_MATCH_BIT : 0);
+    if (d->next.size == 0 && (flags & RE_F_NORESTART)) result |= RE_DEAD_BIT;
+    if (flushes == d->flushes) d->trans.data[state + c] = result;
+
+    return result;
+}
+
+static
+u32 re_dfa_start(Re_Dfa *d, bool bol)
+{
+    if (d->start[bol] == RE_UNKNOWN) {
+        d->next.size = 0;
+        U32s_push_back(&d->next, 0);
+
+        u32 flags = (bol ? RE_F_BOL : 0) |
+                    (d->unanchored ? 0 : RE_F_NORESTART);
+        u32 state = re_dfa_intern(d, flags);
+        d->start[bol] = state;
+    }
+
+    return d->start[bol];
+}
+
+static
+u32 re_dfa_norestart(Re_Dfa *d, u32 state)
+{
+    Re_State st = d->states.data[state / RE_ROW];
+    if (st.flags & RE_F_NORESTART) return state;
+
+    d->next.size = 0;
+    if (st.count > 0) {
+        U32s_push_back_many(&d->next, &d->pcs.data[st.pcs], st.count);
+    }
+    return re_dfa_intern(d, st.flags | RE_F_NORESTART);
+}
+
+static
+u8 re_input_at(const Re_Input *in, u32 offset)
+{
+    const char *data;
+    u32 begin;
+    in->chunk(in->ctx, offset, &data, &begin);
+    return data[offset - begin];
+}
+
+// Returns where the leftmost-first match starting in [from, limit] ends.
+// While the DFA sits in a start state the literal prefix is searched
+// with find_forward instead of stepping byte by byte.
+static
+u32 re_scan_forward(Re_Dfa *d, const Re_Input *in, u32 from, u32 limit)
+{
+    const SB *prefix = &d->re->prefix;
+    bool bol = (from == 0 || re_input_at(in, from - 1) == '\n');
+
+    u32 state = re_dfa_start(d, bol);
+    u32 last_end = NOT_FOUND;
+    u32 pos = from;
+    u32 skip_from = from; // prefilter isn't retried before this offset
+
+    bool accel = prefix->size > 0;
+
+    while (pos < in->size) {
+        const char *data;
+        u32 begin;
+        u32 len = in->chunk(in->ctx, pos, &data, &begin);
+        u32 i = pos - begin;
+
+        while (i < len) {
+            if (accel && pos >= skip_from && pos < limit &&
+                (state == d->start[0] || state == d->start[1])) {
+                u32 k = find_forward(&data[i], len - i,
+                                     prefix->data, prefix->size);
+
+                // a prefix may still straddle the end of the chunk
+                u32 to = (k != NOT_FOUND) ? i + k :
+                         MAX(i, len - MIN(len, prefix->size - 1));
+                to = MIN(to, limit - begin);
+
+                if (to > i) {
+                    i = to;
+                    pos = begin + i;
+                    state = re_dfa_start(d, data[i - 1] == '\n');
+                }
+                skip_from = (k != NOT_FOUND) ? pos + 1 : begin + len;
+                if (i == len) break;
+            }
+
+            if (pos == limit) state = re_dfa_norestart(d, state);
+
+            // step without checks up to the limit or back to a start state
+            u32 run_end = (pos < limit) ? MIN(len, limit - begin) : len;
+            const u32 *trans = d->trans.data;
+
+            while (i < run_end) {
+                u32 t = trans[state + (u8)data[i]];
+                if (t == RE_UNKNOWN) {
+                    t = re_dfa_step(d, state, (u8)data[i]);
+                    trans = d->trans.data;
+                }
+                i++;
+
+                if (t & RE_MATCH_BIT) last_end = begin + i - 1;
+                if (t & RE_DEAD_BIT) return last_end;
+                state = t & RE_ID_MASK;
+
+                if (accel && (state == d->start[0] || state == d->start[1])) {
+                    break;
+                }
+            }
+            pos = begin + i;
+        }
+    }
+
+    if (re_dfa_step(d, state, 256) & RE_MATCH_BIT) last_end = in->size;
+    return last_end;
+}
+
+// Returns the smallest start >= from of a match ending at end.
+static
+u32 re_scan_backward(Re_Dfa *d, const Re_Input *in, u32 end, u32 from)
+{
+    bool bol = (end == in->size || re_input_at(in, end) == '\n');
+
+    u32 state = re_dfa_start(d, bol);
+    u32 best = NOT_FOUND;
+    u32 pos = end;
+
+    while (pos > from) {
+        const char *data;
+        u32 begin;
+        in->chunk(in->ctx, pos - 1, &data, &begin);
+
+        u32 stop = (from > begin) ? from - begin : 0;
+        for (u32 i = pos - begin; i > stop; --i, --pos) {
+            u32 t = re_dfa_step(d, state, (u8)data[i - 1]);
+
+            if (t & RE_MATCH_BIT) best = pos;
+            if (t & RE_DEAD_BIT) return best;
+            state = t & RE_ID_MASK;
+        }
+    }
+
+    u32 c = (from == 0) ? 256 : re_input_at(in, from - 1);
+    if (re_dfa_step(d, state, c) & RE_MATCH_BIT) best = from;
+
+    return best;
+}
+
+static
+void re_cache_create(Re_Cache *c, const Re *re)
+{
+    re_dfa_create(&c->fwd, re, &re->fwd, true);
+    re_dfa_create(&c->rev, re, &re->rev, false);
+}
+
+static
+void re_cache_destroy(Re_Cache *c)
+{
+    re_dfa_destroy(&c->fwd);
+    re_dfa_destroy(&c->rev);
+}
+
+static
+size_t re_cache_bytes(const Re_Cache *c)
+{
+    const Re_Dfa *dfas[2] = { &c->fwd, &c->rev };
+    size_t bytes = 0;
+
+    for (u32 i = 0; i < 2; ++i) {
+        const Re_Dfa *d = dfas[i];
+        bytes += d->states.cap * sizeof(Re_State);
+        bytes += (d->pcs.cap + d->trans.cap + d->table.cap) * sizeof(u32);
+    }
+    return bytes;
+}
+
+// Finds the leftmost-first match starting in [from, limit].
+static
+bool re_search(Re_Cache      *c,
+               const Re_Input *in,
+               u32            from,
+               u32            limit,
+               u32           *begin,
+               u32           *end)
+{
+    u32 e = re_scan_forward(&c->fwd, in, from, limit);
+    if (e == NOT_FOUND) return false;
+
+    u32 s = re_scan_backward(&c->rev, in, e, from);
+    assert(s != NOT_FOUND && s <= e);
+
+    *begin = s;
+    *end = e;
+    return true;
+}
+
+// #########################################################################
+// Journal functions
+// #########################################################################
+
+static
+void journal_create(Journal *j)
+{
+    j->arena = SB_create();
+    j->edits = Edits_create();
+    j->pos = 0;
+    j->sealed = true;
+}
+
+static
+void journal_destroy(Journal *j)
+{
+    SB_destroy(&j->arena);
+    Edits_destroy(&j->edits);
+    memset(j, 0, sizeof(Journal));
+}
+
+static
+void journal_clear(Journal *j)
+{
+    SB_clear(&j->arena);
+    Edits_clear(&j->edits);
+    j->pos = 0;
+    j->sealed = true;
+}
+
+static
+void journal_seal(Journal *j)
+{
+    j->sealed = true;
+}
+
+static
+void journal_record(Journal    *j,
+                    u32         offset,
+                    const char *ins,
+                    u32         ins_len,
+                    const char *del,
+                    u32         del_len)
+{
+    // new edit drops everything that could be redone
+    if (j->pos < j->edits.size) {
+        j->arena.size = Edits_at(&j->edits, j->pos).data;
+        j->edits.size = j->pos;
+    }
+
+    bool single_char = (del_len == 0 && ins_len > 0 &&
+                        ins_len == UTF8_BYTESIZE(ins[0]));
+
+    // consecutive character inserts extend the last edit, its bytes are
+    // always at the end of the arena
+    if (!j->sealed && single_char && j->edits.size > 0) {
+        Edit *last = &j->edits.data[j->edits.size - 1];
+
+        if (last->del_len == 0 && last->offset + last->ins_len == offset) {
+            SB_push_back_many(&j->arena, ins, ins_len);
+            last->ins_len += ins_len;
+            journal_trim(j);
+            return;
+        }
+    }
+
+    Edit e = {
+        .offset = offset,
+        .data = j->arena.size,
+        .ins_len = ins_len,
+        .del_len = del_len
+    };
+
+    if (ins_len > 0) SB_push_back_many(&j->arena, ins, ins_len);
+    if (del_len > 0) SB_push_back_many(&j->arena, del, del_len);
+    Edits_push_back(&j->edits, e);
+    j->pos = j->edits.size;
+
+    j->sealed = !single_char;
+    journal_trim(j);
+}
+
+static
+void journal_trim(Journal *j)
+{
+    size_t used = j->arena.size + j->edits.size * sizeof(Edit);
+    if (used <= UNDO_MEMORY_CAP) return;
+
+    // drop the oldest edits down to 3/4 of the cap so trimming is amortized
+    u32 drop = 0;
+    while (drop < j->edits.size && used > UNDO_MEMORY_CAP / 4 * 3) {
+        Edit e = Edits_at(&j->edits, drop);
+        used -= e.ins_len + e.del_len + sizeof(Edit);
+        drop++;
+    }
+
+    if (drop == j->edits.size) {
+        SB_clear(&j->arena);
+        Edits_clear(&j->edits);
+        j->pos = 0;
+        j->sealed = true;
+        return;
+    }
+
+    u32 base = Edits_at(&j->edits, drop).data;
+    if (base > 0) SB_delete_many(&j->arena, 0, base);
+    Edits_delete_many(&j->edits, 0, drop);
+
+    for (u32 i = 0; i < j->edits.size; ++i) {
+        j->edits.data[i].data -= base;
+    }
+
+    j->pos = (j->pos > drop) ? j->pos - drop : 0;
+}
+
+// Gives the last edit other inserted bytes, its deleted ones stay. This is
+// how the keystrokes of one multi-cursor insert become one undo step.
+static
+void journal_amend(Journal *j, const char *ins, u32 ins_len)
+{
+    assert(j->edits.size > 0 && j->pos == j->edits.size);
+    Edit *last = &j->edits.data[j->edits.size - 1];
+
+    SB del = SB_create();
+    SB_push_back_many(&del, &j->arena.data[last->data + last->ins_len],
+                      last->del_len);
+
+    j->arena.size = last->data;
+    SB_push_back_many(&j->arena, ins, ins_len);
+    SB_push_back_many(&j->arena, del.data, del.size);
+    last->ins_len = ins_len;
+
+    SB_destroy(&del);
+    journal_trim(j);
+}
+
+// #########################################################################
+// Swap functions
+// #########################################################################
+
+static
+void swap_write_all(s32 fd, const char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t written = write(fd, p, n);
+        if (written <= 0) return; // recovery is best effort
+        p += written;
+        n -= written;
+    }
+}
+
+// Returns true if a swap file from an earlier session matches the file on
+// disk and holds at least one complete record to replay. One with only a
+// header had no edits and is removed. swap_record creates the file
+// itself.
+static
+bool swap_open(Swap *s, const char *path, const struct stat *st)
+{
+    s->fd = -1;
+    s->pending = SB_create();
+    s->path = SB_create();
+    s->last_sync_ms = time_ms();
+    s->unsynced = false;
+
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+
+    SB_push_back_many(&s->path, path, name - path);
+    SB_push_back(&s->path, '.');
+    SB_push_back_many(&s->path, name, strlen(name));
+    SB_push_back_many(&s->path, ".ted-swap", strlen(".ted-swap") + 1);
+
+    FILE *fp = fopen(s->path.data, "r");
+    if (fp == NULL) return false;
+
+    Swap_Header h = {0};
+    bool ok = fread(&h, sizeof(h), 1, fp) == 1 &&
+              memcmp(h.magic, SWAP_MAGIC, 8) == 0 &&
+              h.size == (u64)st->st_size &&
+              h.mtime_ns == index_mtime_ns(st) &&
+              h.ino == (u64)st->st_ino &&
+              h.dev == (u64)st->st_dev;
+
+    u32 record[3];
+    bool edited = ok && fread(record, sizeof(record), 1, fp) == 1;
+    if (edited) {
+        long at = ftell(fp);
+        fseek(fp, 0, SEEK_END);
+        edited = ftell(fp) - at >= (long)record[2];
+    }
+
+    fclose(fp);
+    if (ok && !edited) unlink(s->path.data);
+    return edited;
+}
+
+// Forgets the records of a buffer that now matches st on disk, the next
+// one starts a fresh swap file. Used on open and after every save.
+static
+void swap_reset(Swap *s, const struct stat *st)
+{
+    s->pending.size = 0;
+    if (s->off) return;
+
+    if (s->fd >= 0) close(s->fd);
+    s->fd = -1;
+    unlink(s->path.data);
+
+    memcpy(s->header.magic, SWAP_MAGIC, 8);
+    s->header.size = st->st_size;
+    s->header.mtime_ns = index_mtime_ns(st);
+    s->header.ino = st->st_ino;
+    s->header.dev = st->st_dev;
+}
+
+static
+void swap_close(Swap *s, bool keep_file)
+{
+    if (s->fd >= 0) {
+        swap_flush(s, true);
+        close(s->fd);
+        if (!keep_file) unlink(s->path.data);
+    }
+
+    SB_destroy(&s->path);
+    SB_destroy(&s->pending);
+    s->fd = -1;
+}
+
+static
+void swap_record(Swap       *s,
+                 u32         offset,
+                 u32         del_len,
+                 const char *ins,
+                 u32         ins_len)
+{
+    if (s->off) return;
+
+    if (s->fd < 0) {
+        s->fd = open(s->path.data, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (s->fd < 0) {
+            s->off = true; // don't retry on every key
+            return;
+        }
+        SB_push_back_many(&s->pending, (const char *)&s->header,
+                          sizeof(Swap_Header));
+    }
+
+    u32 header[3] = { offset, del_len, ins_len };
+    SB_push_back_many(&s->pending, (const char *)header, sizeof(header));
+
+    if (ins_len >= SWAP_FLUSH_SIZE) {
+        // don't double buffer big pastes
+        swap_flush(s, false);
+        swap_write_all(s->fd, ins, ins_len);
+        s->unsynced = true;
+        return;
+    }
+
+    if (ins_len > 0) SB_push_back_many(&s->pending, ins, ins_len);
+    if (s->pending.size >= SWAP_FLUSH_SIZE) swap_flush(s, false);
+}
+
+static
+void swap_flush(Swap *s, bool sync)
+{
+    if (s->fd < 0) return;
+
+    if (s->pending.size > 0) {
+        swap_write_all(s->fd, s->pending.data, s->pending.size);
+        s->pending.size = 0;
+        s->unsynced = true;
+    }
+
+    u64 now = time_ms();
+    if (s->unsynced && (sync || now - s->last_sync_ms >= SWAP_SYNC_INTERVAL_MS)) {
+        fdatasync(s->fd);
+        s->last_sync_ms = now;
+        s->unsynced = false;
+    }
+}
+
+// Applies the swap file records to data through a gap buffer, so replay
+// costs the journal size plus the distance between consecutive edits
+// instead of a memmove of the whole file per record. A torn record at the
+// end (crash during write) is ignored.
+static
+bool swap_replay(Swap *s, SB *data)
+{
+    FILE *fp = fopen(s->path.data, "r");
+    if (fp == NULL) return false;
+
+    fseek(fp, 0, SEEK_END);
+    long journal_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    SB journal = SB_create();
+    SB_reserve_cap(&journal, journal_size);
+    journal.size = fread(journal.data, 1, journal_size, fp);
+    fclose(fp);
+
+    const u32 header_size = sizeof(Swap_Header);
+    const u32 record_size = 3 * sizeof(u32);
+
+    // capacity bound: every record may insert, none may delete
+    size_t total_ins = 0;
+    for (size_t i = header_size; i + record_size <= journal.size;) {
+        u32 r[3];
+        memcpy(r, &journal.data[i], record_size);
+        total_ins += r[2];
+        i += record_size + r[2];
+    }
+
+    size_t cap = data->size + total_ins;
+    SB_reserve_cap(data, MAX(cap, 1));
+    char *g = data->data;
+
+    size_t gap_begin = data->size;
+    size_t gap_end = cap;
+    bool ok = true;
+
+    for (size_t i = header_size; i + record_size <= journal.size;) {
+        u32 r[3];
+        memcpy(r, &journal.data[i], record_size);
+        if (i + record_size + r[2] > journal.size) break; // torn write
+
+        u32 offset = r[0], del_len = r[1], ins_len = r[2];
+        size_t text_size = gap_begin + (cap - gap_end);
+        if ((size_t)offset + del_len > text_size) {
+            ok = false;
+            break;
+        }
+
+        if (offset < gap_begin) {
+            size_t n = gap_begin - offset;
+            memmove(&g[gap_end - n], &g[offset], n);
+            gap_begin -= n;
+            gap_end -= n;
+        } else if (offset > gap_begin) {
+            size_t n = offset - gap_begin;
+            memmove(&g[gap_begin], &g[gap_end], n);
+            gap_begin += n;
+            gap_end += n;
+        }
+
+        gap_end += del_len;
+        memcpy(&g[gap_begin], &journal.data[i + record_size], ins_len);
+        gap_begin += ins_len;
+
+        i += record_size + ins_len;
+    }
+
+    memmove(&g[gap_begin], &g[gap_end], cap - gap_end);
+    data->size = gap_begin + (cap - gap_end);
+
+    SB_destroy(&journal);
+    return ok;
+}
+
+// #########################################################################
+// Index functions
+// #########################################################################
+
+static
+u64 index_mtime_ns(const struct stat *st)
+{
+    return (u64)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// $XDG_CACHE_HOME/ted or ~/.cache/ted, made if missing. Without one the
+// files are scanned every time like without --cache.
+static
+void cache_dir_open(void)
+{
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    SB_clear(&cache_dir);
+    if (xdg && xdg[0]) {
+        sb_appendf(&cache_dir, "%s", xdg);
+    } else if (home && home[0]) {
+        sb_appendf(&cache_dir, "%s/.cache", home);
+    } else {
+        return;
+    }
+    SB_push_back(&cache_dir, '\0');
+    mkdir(cache_dir.data, 0700);
+
+    cache_dir.size--;
+    sb_appendf(&cache_dir, "/ted");
+    SB_push_back(&cache_dir, '\0');
+
+    struct stat st;
+    if (mkdir(cache_dir.data, 0700) != 0 &&
+        (stat(cache_dir.data, &st) != 0 || !S_ISDIR(st.st_mode))) {
+        SB_clear(&cache_dir);
+        return;
+    }
+    cache_dir.size--; // the terminator stays after the end
+}
+
+// The index of a file is named after a hash of its absolute path and the
+// stride, so the pager's and the editor's indexes of a file both stay.
+static
+bool index_path(const char *path, u64 stride, SB *out)
+{
+    if (cache_dir.size == 0) return false;
+
+    char *full = realpath(path, NULL);
+    if (full == NULL) return false;
+
+    u64 hash = 14695981039346656037ull;
+    for (const char *c = full; *c; ++c) {
+        hash = (hash ^ (u8)*c) * 1099511628211ull;
+    }
+    free(full);
+
+    SB_clear(out);
+    sb_appendf(out, "%.*s/%016lx-%lu", (s32)cache_dir.size, cache_dir.data,
+               hash, stride);
+    SB_push_back(out, '\0');
+    return true;
+}
+
+// Maps the index of path if it was made with stride for the file as st
+// describes it. Comparing the header is the whole validation, the varints
+// are only checked for staying in bounds as they are read.
+static
+bool index_open(Index *x, const char *path, const struct stat *st, u64 stride)
+{
+    memset(x, 0, sizeof(Index));
+
+    SB name = SB_create();
+    s32 fd = index_path(path, stride, &name) ? open(name.data, O_RDONLY) : -1;
+    SB_destroy(&name);
+    if (fd < 0) return false;
+
+    struct stat own;
+    bool ok = fstat(fd, &own) == 0 &&
+              (u64)own.st_size >= sizeof(Index_Header);
+    const u8 *map = MAP_FAILED;
+    if (ok) map = mmap(NULL, own.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    Index_Header *h = &x->header;
+    memcpy(h, map, sizeof(Index_Header));
+    x->map = map;
+    x->at = map + sizeof(Index_Header);
+    x->end = map + own.st_size;
+
+    if (memcmp(h->magic, INDEX_MAGIC, 8) != 0 ||
+        h->size != (u64)st->st_size ||
+        h->mtime_ns != index_mtime_ns(st) ||
+        h->ino != (u64)st->st_ino ||
+        h->dev != (u64)st->st_dev ||
+        h->stride != stride ||
+        h->count == 0 || h->count > h->size + 1 ||
+        h->bytes != (u64)(x->end - x->at)) {
+        index_close(x);
+        return false;
+    }
+    return true;
+}
+
+// Reads the next line start, false past the end or out of the file.
+static
+bool index_next(Index *x, u64 *start, bool *flag)
+{
+    u64 delta = 0;
+    for (u32 shift = 0; ; shift += 7) {
+        if (x->at == x->end || shift > 63) return false;
+        u8 byte = *x->at++;
+        delta |= (u64)(byte & 0x7f) << shift;
+        if (byte < 0x80) break;
+    }
+
+    *flag = delta & 1;
+    delta >>= 1;
+    if (delta > x->header.size - x->value) return false;
+    x->value += delta;
+    *start = x->value;
+    return true;
+}
+
+static
+void index_close(Index *x)
+{
+    if (x->map) munmap((void *)x->map, x->end - x->map);
+    memset(x, 0, sizeof(Index));
+}
+
+static
+void index_put(SB *varints, u64 delta, bool flag)
+{
+    delta = delta << 1 | flag;
+    while (delta >= 0x80) {
+        SB_push_back(varints, (char)(delta | 0x80));
+        delta >>= 7;
+    }
+    SB_push_back(varints, (char)delta);
+}
+
+// Replaces the index of path through a rename, so it is never seen half
+// written. Failing to is fine, the next open scans the file again.
+static
+void index_write(const char        *path,
+                 const struct stat *st,
+                 u64                stride,
+                 u64                count,
+                 const SB          *varints)
+{
+    SB name = SB_create();
+    if (!index_path(path, stride, &name)) {
+        SB_destroy(&name);
+        return;
+    }
+
+    SB temp = SB_create();
+    sb_appendf(&temp, "%s.%d", name.data, (s32)getpid());
+    SB_push_back(&temp, '\0');
+
+    Index_Header h = {0};
+    memcpy(h.magic, INDEX_MAGIC, 8);
+    h.size = st->st_size;
+    h.mtime_ns = index_mtime_ns(st);
+    h.ino = st->st_ino;
+    h.dev = st->st_dev;
+    h.stride = stride;
+    h.count = count;
+    h.bytes = varints->size;
+
+    s32 fd = open(temp.data, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    bool ok = fd >= 0 &&
+              write(fd, &h, sizeof(h)) == sizeof(h) &&
+              write(fd, varints->data, varints->size) ==
+              (ssize_t)varints->size;
+    if (fd >= 0) close(fd);
+    if (fd >= 0 && (!ok || rename(temp.data, name.data) != 0)) {
+        unlink(temp.data);
+    }
+
+    SB_destroy(&temp);
+    SB_destroy(&name);
+}
+
+// Fills lines from the index instead of scanning the data, false if there
+// is no usable one.
+static
+bool index_load_lines(Lines *lines, U64s *ascii, const char *path,
+                      const struct stat *st)
+{
+    if ((u64)st->st_size < INDEX_MIN_SIZE) return false;
+
+    Index x;
+    if (!index_open(&x, path, st, 1)) return false;
+
+    u64 t = time_ns();
+    lines->size = 0;
+    Lines_reserve_cap(lines, x.header.count);
+
+    u64 start = 0;
+    bool flag = false;
+    bool ok = index_next(&x, &start, &flag) && start == 0;
+    Line line = {0};
+
+    for (u64 i = 1; ok && i < x.header.count; ++i) {
+        bit_set(ascii, lines->size, flag);
+        ok = index_next(&x, &start, &flag) && start > line.begin;
+        line.end = start - 1;
+        Lines_push_back(lines, line);
+        line.begin = start;
+    }
+    bit_set(ascii, lines->size, flag);
+    line.end = st->st_size;
+    Lines_push_back(lines, line);
+
+    ok = ok && x.at == x.end;
+    index_close(&x);
+
+    profile_add(PHASE_TOKENIZE, t);
+    return ok;
+}
+
+static
+void index_store_lines(const Lines *lines, const U64s *ascii,
+                       const char *path, const struct stat *st)
+{
+    if ((u64)st->st_size < INDEX_MIN_SIZE || cache_dir.size == 0) return;
+
+    SB varints = SB_create();
+    u32 prev = 0;
+    for (u32 i = 0; i < lines->size; ++i) {
+        index_put(&varints, lines->data[i].begin - prev, bit_get(ascii, i));
+        prev = lines->data[i].begin;
+    }
+
+    index_write(path, st, 1, lines->size, &varints);
+    SB_destroy(&varints);
+}
+
+// #########################################################################
+// Watch functions
+// #########################################################################
+
+static
+void watch_start(Buffer *b)
+{
+    Watch *w = &b->watch;
+
+    char dir[TEMP_BUF_SIZE] = {0};
+    strncpy(dir, b->path.data, MIN(b->path.size, TEMP_BUF_SIZE - 1));
+
+    char *slash = strrchr(dir, '/');
+    const char *name = slash ? slash + 1 : dir;
+
+    w->name = SB_create();
+    SB_push_back_many(&w->name, name, strlen(name) + 1);
+
+    if (slash == dir) {
+        dir[1] = '\0';
+    } else if (slash) {
+        *slash = '\0';
+    } else {
+        strcpy(dir, ".");
+    }
+
+    w->dir = SB_create();
+    SB_push_back_many(&w->dir, dir, strlen(dir) + 1);
+
+    w->fd = inotify_init1(IN_NONBLOCK);
+    if (w->fd < 0) return;
+
+    watch_subscribe(w, false);
+}
+
+// Growth only matters when following, and every write to any file in the
+// directory would wake the editor up, the swap file's included.
+static
+void watch_subscribe(Watch *w, bool growth)
+{
+    if (w->fd < 0) return;
+
+    u32 mask = IN_CLOSE_WRITE | IN_MOVED_TO | (growth ? IN_MODIFY : 0);
+    if (inotify_add_watch(w->fd, w->dir.data, mask) < 0) {
+        close(w->fd);
+        w->fd = -1;
+    }
+}
+
+static
+void watch_stop(Buffer *b)
+{
+    Watch *w = &b->watch;
+
+    if (w->fd >= 0) close(w->fd);
+    w->fd = -1;
+    SB_destroy(&w->name);
+    SB_destroy(&w->dir);
+}
+
+// Reads the pending events. A file written or renamed into place is
+// reloaded when the buffer has no unsaved edits, otherwise the buffer is
+// marked as changed on disk. Growth alone only matters when following.
+// Returns true if the buffer or its state changed.
+static
+bool watch_update(Buffer *b)
+{
+    Watch *w = &b->watch;
+    u32 mask = 0;
+
+    char events[TEMP_BUF_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    s64 n;
+    while ((n = read(w->fd, events, TEMP_BUF_SIZE)) > 0) {
+        for (char *p = events; p < events + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->len > 0 && strcmp(ev->name, w->name.data) == 0) {
+                mask |= ev->mask;
+            } else if (ev->mask & IN_Q_OVERFLOW) {
+                mask |= IN_MODIFY | IN_CLOSE_WRITE; // lost, check anyway
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    if (b->follow.on) {
+        return (mask & (IN_MODIFY | IN_CLOSE_WRITE)) && follow_update(b);
+    }
+    if (!(mask & (IN_CLOSE_WRITE | IN_MOVED_TO))) return false;
+
+    char path[TEMP_BUF_SIZE] = {0};
+    strncpy(path, b->path.data, MIN(b->path.size, TEMP_BUF_SIZE - 1));
+
+    struct stat st;
+    if (stat(path, &st) != 0) return false;
+
+    // our own save, or written again with the same contents and times
+    if (st.st_ino == w->disk.st_ino && st.st_dev == w->disk.st_dev &&
+        st.st_size == w->disk.st_size &&
+        st.st_mtim.tv_sec == w->disk.st_mtim.tv_sec &&
+        st.st_mtim.tv_nsec == w->disk.st_mtim.tv_nsec) {
+        return false;
+    }
+
+    if (b->saved) return buffer_reload(b);
+
+    w->changed = true;
+    return true;
+}
+
+// #########################################################################
+// Follow functions
+// #########################################################################
+
+static
+bool follow_start(Buffer *b)
+{
+    Follow *f = &b->follow;
+
+    char path[TEMP_BUF_SIZE] = {0};
+    strncpy(path, b->path.data, MIN(b->path.size, TEMP_BUF_SIZE - 1));
+
+    if (b->watch.fd < 0) return false;
+
+    f->fd = open(path, O_RDONLY);
+    if (f->fd < 0) return false;
+
+    f->on = true;
+    watch_subscribe(&b->watch, true);
+    follow_update(b); // what was written since the file was loaded
+    if (b->lines.size > 0) move_bottom(b);
+    return true;
+}
+
+static
+void follow_stop(Buffer *b)
+{
+    Follow *f = &b->follow;
+
+    if (f->fd >= 0) close(f->fd);
+    f->fd = -1;
+    f->on = false;
+    watch_subscribe(&b->watch, false);
+}
+
+// Appends what was written to the file since the last update, the cost is
+// the appended bytes. A cursor on the last line stays there. Returns false
+// if there was nothing new. A buffer without its lines waits
+// for buffer_activate.
+static
+bool follow_update(Buffer *b)
+{
+    Follow *f = &b->follow;
+    if (b->lines.size == 0) return false;
+
+    struct stat st;
+    if (fstat(f->fd, &st) != 0) return false;
+    b->watch.disk = st;
+
+    // truncated: go on from the new end like tail -f
+    if ((u64)st.st_size < f->offset) f->offset = st.st_size;
+
+    u64 n = MIN((u64)st.st_size - f->offset, NOT_FOUND - 1 - b->data.size);
+    if (n == 0) return false;
+
+    count_cancel(&b->search.count);
+    bool at_bottom = get_cursor_row(b) + 1 == b->lines.size;
+
+    u32 old_size = b->data.size;
+    SB_grow(&b->data, n);
+
+    s64 got = pread(f->fd, &b->data.data[old_size], n, f->offset);
+    if (got <= 0) return false;
+
+    u32 last_row = b->lines.size - 1;
+    if (b->brackets.on) highlight_sync(b, last_row + 1);
+
+    b->data.size += got;
+    f->offset += got;
+    lines_append(&b->lines, &b->ascii, &b->data, old_size);
+    highlight_edit(&b->highlight, last_row, 0, b->lines.size - 1 - last_row);
+    brackets_edit(b, last_row, b->lines.size - 1 - last_row, old_size, got);
+
+    if (at_bottom) move_bottom(b);
+    return true;
+}
+
+// #########################################################################
+// Buffer functions
+// #########################################################################
+
+static
+u32 buffer_create_from_file(Buffer *b, const char *path)
+{
+    memset(b, 0, sizeof(Buffer));
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return 0;
+
+    fseek(fp, 0, SEEK_END);
+    u32 file_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    SB_reserve_cap(&b->data, file_size);
+    fread(b->data.data, 1, file_size, fp);
+    b->data.size = file_size;
+
+    b->saved = true;
+    fstat(fileno(fp), &b->watch.disk);
+
+    if (headless) {
+        swap_open(&b->swap, path, &b->watch.disk);
+        b->swap.off = true;
+    } else if (swap_open(&b->swap, path, &b->watch.disk)) {
+        printf("%s has unsaved edits from a previous session, "
+               "recover them? [y/N] ", path);
+        fflush(stdout);
+
+        char answer[TEMP_BUF_SIZE] = {0};
+        if (fgets(answer, TEMP_BUF_SIZE, stdin) && answer[0] == 'y') {
+            if (!swap_replay(&b->swap, &b->data)) {
+                printf("swap file is damaged, recovered what was readable\n");
+            }
+            b->saved = false;
+        }
+    }
+    swap_reset(&b->swap, &b->watch.disk);
+    if (!b->saved) {
+        // the recovered edits as one record, until the next save
+        swap_record(&b->swap, 0, file_size, b->data.data, b->data.size);
+        swap_flush(&b->swap, true);
+    }
+
+    b->lines = Lines_create();
+    b->ascii = U64s_create();
+    if (!b->saved ||
+        !index_load_lines(&b->lines, &b->ascii, path, &b->watch.disk)) {
+        tokenize_lines(&b->lines, &b->ascii, &b->data);
+        if (b->saved) {
+            index_store_lines(&b->lines, &b->ascii, path, &b->watch.disk);
+        }
+    }
+    highlight_create(&b->highlight, path);
+    brackets_build(b);
+
+    b->follow.fd = -1;
+    b->follow.offset = file_size;
+
+    b->path = SB_create();
+    SB_push_back_many(&b->path, path, strlen(path));
+
+    b->watch.fd = -1;
+    if (!headless) watch_start(b);
+
+    journal_create(&b->journal);
+
+    fclose(fp);
+    return b->lines.size;
+}
+
+static
+void buffer_save(Buffer *b)
+{
+    char path[TEMP_BUF_SIZE] = {0};
+    strncpy(path, b->path.data, b->path.size);
+
+    FILE *fp = fopen(path, "w");
+    assert(fp);
+
+    fwrite(b->data.data, 1, b->data.size, fp);
+
+    fclose(fp);
+    b->saved = true;
+    b->follow.offset = b->data.size;
+
+    stat(path, &b->watch.disk);
+    b->watch.changed = false;
+    index_store_lines(&b->lines, &b->ascii, path, &b->watch.disk);
+
+    swap_reset(&b->swap, &b->watch.disk);
+}
+
+// Reads the file again into the same data and lines, the cursor stays on
+// its line. Undo history refers to the old contents and is dropped.
+static
+bool buffer_reload(Buffer *b)
+{
+    char path[TEMP_BUF_SIZE] = {0};
+    strncpy(path, b->path.data, MIN(b->path.size, TEMP_BUF_SIZE - 1));
+
+    s32 fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (u64)st.st_size >= NOT_FOUND) {
+        close(fd);
+        return false;
+    }
+
+    count_cancel(&b->search.count);
+    clipboard_detach(b->clipboard, b, 0);
+    multi_cursor_stop(b);
+    u32 row = get_cursor_row(b);
+
+    b->data.size = 0;
+    SB_grow(&b->data, st.st_size);
+
+    s64 got;
+    while (b->data.size < (u64)st.st_size &&
+           (got = read(fd, &b->data.data[b->data.size],
+                       st.st_size - b->data.size)) > 0) {
+        b->data.size += got;
+    }
+    close(fd);
+
+    tokenize_lines(&b->lines, &b->ascii, &b->data);
+    highlight_reset(&b->highlight);
+    brackets_build(b);
+    journal_clear(&b->journal);
+    swap_reset(&b->swap, &st);
+
+    set_cursor_col_after_vertical_move(
+        b, Lines_at(&b->lines, MIN(row, b->lines.size - 1)));
+    if (b->mode == REGION_MODE) {
+        b->region_begin = MIN(b->region_begin, b->data.size);
+    }
+    b->search.origin = MIN(b->search.origin, b->data.size);
+
+    b->saved = true;
+    b->follow.offset = b->data.size;
+    b->watch.disk = st;
+    b->watch.changed = false;
+    return true;
+}
+
+static
+void buffer_kill(Buffer *b)
+{
+    count_cancel(&b->search.count); // reads data until it stops
+    if (b->clipboard) clipboard_detach(b->clipboard, b, 0);
+
+    SB_destroy(&b->data);
+    U32s_destroy(&b->cursors);
+    SB_destroy(&b->path);
+    SB_destroy(&b->goto_input);
+    SB_destroy(&b->search.query);
+    if (b->search.compiled) {
+        re_cache_destroy(&b->search.cache);
+        re_destroy(&b->search.re);
+    }
+    Lines_destroy(&b->lines);
+    U64s_destroy(&b->ascii);
+    highlight_destroy(&b->highlight);
+    brackets_destroy(&b->brackets);
+    follow_stop(b);
+    watch_stop(b);
+    journal_destroy(&b->journal);
+    swap_close(&b->swap, false);
+    memset(b, 0, sizeof(Buffer));
+}
+
+// Bytes of what can be derived from data again: lines, highlight states,
+// brackets, search matches and the lazy DFA.
+static
+size_t buffer_cache_bytes(const Buffer *b)
+{
+    size_t bytes = b->lines.cap * sizeof(Line);
+    bytes += b->ascii.cap * sizeof(u64);
+    bytes += b->highlight.states.cap;
+    bytes += b->brackets.slots.cap * sizeof(Bracket);
+    bytes += b->brackets.tree.cap * sizeof(Bracket_Range);
+    bytes += b->search.count.matches.cap * sizeof(u32);
+    if (b->search.compiled) bytes += re_cache_bytes(&b->search.cache);
+    return bytes;
+}
+
+// Frees the caches of an inactive buffer, buffer_activate builds the
+// needed ones again.
+static
+void buffer_release_caches(Buffer *b)
+{
+    count_cancel(&b->search.count);
+    Lines_destroy(&b->lines);
+    U64s_destroy(&b->ascii);
+
+    U8s_destroy(&b->highlight.states);
+    U8s_push_back(&b->highlight.states, 0);
+    highlight_reset(&b->highlight);
+    brackets_destroy(&b->brackets);
+
+    if (b->search.compiled) {
+        re_cache_destroy(&b->search.cache);
+        re_cache_create(&b->search.cache, &b->search.re);
+    }
+}
+
+static
+void buffer_activate(Buffer *b)
+{
+    if (b->lines.size == 0) {
+        char path[TEMP_BUF_SIZE] = {0};
+        strncpy(path, b->path.data, MIN(b->path.size, TEMP_BUF_SIZE - 1));
+
+        if (!b->saved ||
+            !index_load_lines(&b->lines, &b->ascii, path, &b->watch.disk)) {
+            tokenize_lines(&b->lines, &b->ascii, &b->data);
+        }
+        brackets_build(b);
+    }
+
+    watch_update(b); // events that came while it was inactive
+    if (b->follow.on) follow_update(b); // growth it skipped meanwhile
+}
+
+// Releases the caches of the least recently active buffers until those of
+// all inactive buffers fit in CACHE_MEMORY_BUDGET.
+static
+void buffers_trim(void)
+{
+    for (;;) {
+        size_t total = 0;
+        Buffer *oldest = NULL;
+
+        for (u32 i = 0; i < buffers.size; ++i) {
+            Buffer *b = buffers.data[i];
+            size_t bytes = buffer_cache_bytes(b);
+            if (b == current_b || bytes == 0 || b->lines.size == 0) continue;
+
+            total += bytes;
+            if (!oldest || b->last_active_ns < oldest->last_active_ns) {
+                oldest = b;
+            }
+        }
+
+        if (total <= CACHE_MEMORY_BUDGET) return;
+        buffer_release_caches(oldest);
+    }
+}
+
+// Replaces del_len bytes at offset with ins without touching the journal.
+static
+void buffer_apply(Buffer     *b,
+                  u32         offset,
+                  u32         del_len,
+                  const char *ins,
+                  u32         ins_len)
+{
+    swap_record(&b->swap, offset, del_len, ins, ins_len);
+    buffer_splice(b, offset, del_len, ins, ins_len);
+}
+
+// buffer_apply for callers that put their own records in the swap.
+static
+void buffer_splice(Buffer     *b,
+                   u32         offset,
+                   u32         del_len,
+                   const char *ins,
+                   u32         ins_len)
+{
+    clipboard_detach(b->clipboard, b, offset);
+    count_cancel(&b->search.count);
+
+    u32 row = lines_find_row(&b->lines, offset);
+    u32 removed = count_newlines(&b->data.data[offset], del_len);
+    u32 added = count_newlines(ins, ins_len);
+
+    // brackets_edit reads the states of the lines around the edit as they
+    // were before it
+    if (b->brackets.on) highlight_sync(b, row + removed + 2);
+
+    if (del_len > 0) SB_delete_many(&b->data, offset, del_len);
+    if (ins_len > 0) SB_push_many(&b->data, offset, ins, ins_len);
+
+    b->saved = false;
+    lines_edit(&b->lines, &b->ascii, &b->data, row, removed, added, del_len,
+               ins_len);
+    highlight_edit(&b->highlight, row, removed, added);
+    brackets_edit(b, row, added, offset, ins_len);
+}
+
+static
+void buffer_insert(Buffer *b, u32 offset, const char *s, u32 n)
+{
+    journal_record(&b->journal, offset, s, n, NULL, 0);
+    buffer_apply(b, offset, 0, s, n);
+}
+
+static
+void buffer_delete(Buffer *b, u32 offset, u32 n)
+{
+    journal_record(&b->journal, offset, NULL, 0, &b->data.data[offset], n);
+    buffer_apply(b, offset, n, NULL, 0);
+}
+
+// #########################################################################
+// Clipboard functions
+// #########################################################################
+
+static
+void clipboard_destroy(Clipboard *c)
+{
+    Clip_Pieces_destroy(&c->pieces);
+    SB_destroy(&c->bytes);
+    memset(c, 0, sizeof(Clipboard));
+}
+
+static
+void clipboard_clear(Clipboard *c)
+{
+    Clip_Pieces_clear(&c->pieces);
+    SB_clear(&c->bytes);
+    c->size = 0;
+    c->chars = 0;
+}
+
+// Appends a reference to the range, nothing is copied yet.
+static
+void clipboard_append(Clipboard *c, const Buffer *b, u32 begin, u32 len)
+{
+    if (len == 0) return;
+    assert(c->size + len < NOT_FOUND && "Clipboard too large");
+
+    Clip_Piece piece = { .source = b, .begin = begin, .len = len };
+    Clip_Pieces_push_back(&c->pieces, piece);
+
+    c->chars += count_utf8_chars(&b->data.data[begin], len);
+    c->size += len;
+}
+
+// Copies the pieces of b that reach past from, before b changes there.
+// Pieces that end before from keep referring to b.
+static
+void clipboard_detach(Clipboard *c, const Buffer *b, u32 from)
+{
+    for (u32 i = 0; i < c->pieces.size; ++i) {
+        Clip_Piece *piece = &c->pieces.data[i];
+        if (piece->source != b || piece->begin + piece->len <= from) continue;
+
+        u32 at = c->bytes.size;
+        SB_push_back_many(&c->bytes, &b->data.data[piece->begin], piece->len);
+        piece->source = NULL;
+        piece->begin = at;
+    }
+}
+
+// The contents in one run that stays valid while target is edited. A
+// single piece of another buffer is used in place, otherwise the pieces
+// are joined once into the clipboard's bytes.
+static
+const char *clipboard_data(Clipboard *c, const Buffer *target)
+{
+    if (c->pieces.size == 1) {
+        Clip_Piece piece = c->pieces.data[0];
+        if (piece.source == NULL) return &c->bytes.data[piece.begin];
+        if (piece.source != target) {
+            return &piece.source->data.data[piece.begin];
+        }
+    }
+
+    SB joined = SB_create();
+    SB_reserve_cap(&joined, c->size);
+    for (u32 i = 0; i < c->pieces.size; ++i) {
+        Clip_Piece piece = c->pieces.data[i];
+        const char *data = piece.source ? piece.source->data.data
+                                        : c->bytes.data;
+        SB_push_back_many(&joined, &data[piece.begin], piece.len);
+    }
+
+    SB_destroy(&c->bytes);
+    c->bytes = joined;
+    Clip_Pieces_clear(&c->pieces);
+    Clip_Pieces_push_back(&c->pieces,
+                          (Clip_Piece){ .source = NULL, .begin = 0,
+                                        .len = c->size });
+    return c->bytes.data;
+}
+
+// #########################################################################
+// Editor functions
+// #########################################################################
+
+static
+void move_down(Buffer *b)
+{
+    u32 cursor_row = get_cursor_row(b);
+    if (cursor_row + 1 == b->lines.size) return;
+
+    Line next_line = Lines_at(&b->lines, cursor_row + 1);
+    set_cursor_col_after_vertical_move(b, next_line);
+}
+
+static
+void move_up(Buffer *b)
+{
+    u32 cursor_row = get_cursor_row(b);
+    if (cursor_row == 0) return;
+
+    Line next_line = Lines_at(&b->lines, cursor_row - 1);
+    set_cursor_col_after_vertical_move(b, next_line);
+}
+
+static
+void move_right(Buffer *b)
+{
+    if (b->cursor == b->data.size) return;
+
+    b->cursor += UTF8_BYTESIZE(SB_at(&b->data, b->cursor));
+    update_last_visual_col(b);
+}
+
+static
+void move_left(Buffer *b)
+{
+    if (b->cursor == 0) return;
+
+    b->cursor--;
+    while (UTF8_BYTESIZE(SB_at(&b->data, b->cursor)) == 0) {
+        b->cursor--;
+    }
+
+    update_last_visual_col(b);
+}
+
+static
+void move_down_page(Buffer *b)
+{
+    u32 cursor_row = get_cursor_row(b);
+
+    Line next_line = {0};
+    if (cursor_row + CONTENTS_HEIGHT / 2 >= b->lines.size) {
+        next_line = Lines_at(&b->lines, b->lines.size - 1);
+    } else {
+        next_line = Lines_at(&b->lines, cursor_row + CONTENTS_HEIGHT / 2);
+    }
+
+    set_cursor_col_after_vertical_move(b, next_line);
+}
+
+static
+void move_up_page(Buffer *b)
+{
+    u32 cursor_row = get_cursor_row(b);
+
+    Line next_line = {0};
+    if (cursor_row < CONTENTS_HEIGHT / 2) {
+        next_line = Lines_at(&b->lines, 0);
+    } else {
+        next_line = Lines_at(&b->lines, cursor_row - CONTENTS_HEIGHT / 2);
+    }
+
+    set_cursor_col_after_vertical_move(b, next_line);
+}
+
+static
+void move_line_first_char(Buffer *b)
+{
+    u32 cursor_row = get_cursor_row(b);
+    Line cursor_line = Lines_at(&b->lines, cursor_row);
+
+    b->cursor = cursor_line.begin;
+
+    b->last_visual_col = 0;
+}
+
+static
+void move_line_begin(Buffer *b)
+{
+    u32 cursor_row = get_cursor_row(b);
+    Line cursor_line = Lines_at(&b->lines, cursor_row);
+
+    b->cursor = cursor_line.begin;
+    while (SB_at(&b->data, b->cursor) == ' ') {
+        b->cursor += 1;
+    }
+
+    update_last_visual_col(b);
+}
+
+static
+void move_line_end(Buffer *b)
+{
+    u32 cursor_row = get_cursor_row(b);
+    Line cursor_line = Lines_at(&b->lines, cursor_row);
+
+    b->cursor = cursor_line.end;
+
+    update_last_visual_col(b);
+}
+
+static
+void move_top(Buffer *b)
+{
+    b->cursor = 0;
+    b->last_visual_col = 0;
+}
+
+static
+void move_bottom(Buffer *b)
+{
+    Line bottom_line = Lines_at(&b->lines, b->lines.size - 1);
+    b->cursor = bottom_line.begin;
+    b->last_visual_col = 0;
+}
+
+static
+void center_cursor_line(Buffer *b)
+{
+    u32 cursor_row = get_cursor_row(b);
+
+    if (cursor_row <= CONTENTS_HEIGHT / 2) {
+        b->row_offset = 0;
+    } else {
+        b->row_offset = cursor_row - CONTENTS_HEIGHT / 2;
+    }
+}
+
+static
+void insert_char_at_cursor(Buffer *b, char c)
+{
+    if (UTF8_BYTESIZE(c) > 0) {
+        b->typed_size = UTF8_BYTESIZE(c);
+        b->typed_count = 0;
+        memset(b->typed, 0, 4);
+    }
+
+    if (b->typed_count == 4) return; // continuation bytes without a lead
+    b->typed[b->typed_count++] = c;
+
+    if (b->typed_count == b->typed_size) {
+        u8 size = b->typed_size;
+        if (b->cursors.size > 0) {
+            multi_cursor_edit(b, false, b->typed, size);
+            return;
+        }
+        buffer_insert(b, b->cursor, b->typed, size);
+
+        b->cursor += size;
+
+        if (b->typed[0] == '\n') {
+            b->last_visual_col = 0;
+        } else {
+            b->last_visual_col += 1;
+        }
+
+        update_last_visual_col(b);
+    }
+}
+
+static
+void insert_indent_spaces_at_cursor(Buffer *b)
+{
+    const char buf[9] = "        "; // 8 spaces maximum
+    if (b->cursors.size > 0) {
+        multi_cursor_edit(b, false, buf, INDENT_SPACES);
+        return;
+    }
+    buffer_insert(b, b->cursor, buf, INDENT_SPACES);
+    b->cursor += INDENT_SPACES;
+
+    update_last_visual_col(b);
+}
+
+static
+void backspace(Buffer *b)
+{
+    if (b->cursors.size > 0) {
+        multi_cursor_edit(b, true, NULL, 0);
+        return;
+    }
+    if (b->cursor == 0) return;
+
+    b->cursor--;
+    while (UTF8_BYTESIZE(SB_at(&b->data, b->cursor)) == 0) {
+        b->cursor--;
+    }
+
+    u8 size = UTF8_BYTESIZE(SB_at(&b->data, b->cursor));
+    buffer_delete(b, b->cursor, size);
+
+    update_last_visual_col(b);
+}
+
+// One cursor per line of the region, at the column of the cursor. Insert
+// mode then types at all of them until escape.
+static
+void multi_cursor_start(Buffer *b)
+{
+    update_last_visual_col(b);
+
+    u32 row = get_cursor_row(b);
+    u32 other = lines_find_row(&b->lines, b->region_begin);
+    u32 top = MIN(row, other);
+    u32 bottom = MAX(row, other);
+
+    discard_region(b);
+    U32s_clear(&b->cursors);
+    for (u32 r = top; r <= bottom; ++r) {
+        Line line = Lines_at(&b->lines, r);
+        U32s_push_back(&b->cursors,
+                       line_offset_at_visual_col(b, line, b->last_visual_col));
+    }
+
+    b->cursor_main = row - top;
+    b->cursor = b->cursors.data[b->cursor_main];
+    journal_seal(&b->journal);
+    b->mode = INSERT_MODE;
+}
+
+static
+void multi_cursor_stop(Buffer *b)
+{
+    U32s_clear(&b->cursors);
+    b->cursor_main = 0;
+}
+
+// Deletes the character before every cursor if erase, then inserts ins at
+// every cursor. It is all one edit from the first change to the last
+// cursor, so the data moves and the lines are rebuilt once whatever the
+// number of cursors.
+static
+void multi_cursor_edit(Buffer *b, bool erase, const char *ins, u32 ins_len)
+{
+    U32s *cursors = &b->cursors;
+    SB out = SB_create();
+
+    u32 first = 0;
+    u32 copied = 0; // data before this is in out or deleted
+    u32 main = 0;
+
+    for (u32 i = 0; i < cursors->size; ++i) {
+        u32 at = cursors->data[i];
+        u32 from = at;
+
+        // never past the previous cursor, what is before it is its own
+        if (erase && at > copied) {
+            from--;
+            while (from > copied &&
+                   UTF8_BYTESIZE(SB_at(&b->data, from)) == 0) {
+                from--;
+            }
+        }
+        if (i == 0) first = copied = from;
+
+        SB_push_back_many(&out, &b->data.data[copied], from - copied);
+        if (from < at || ins_len > 0) {
+            // where the edits of the cursors before put it
+            swap_record(&b->swap, first + out.size, at - from, ins, ins_len);
+        }
+        if (ins_len > 0) SB_push_back_many(&out, ins, ins_len);
+        copied = at;
+
+        cursors->data[i] = first + out.size;
+        if (i == b->cursor_main) main = cursors->data[i];
+    }
+
+    u32 last = copied;
+    if (last > first || out.size > 0) {
+        Journal *j = &b->journal;
+        Edit *e = j->edits.size ? &j->edits.data[j->edits.size - 1] : NULL;
+
+        if (!j->sealed && j->pos == j->edits.size && e &&
+            e->offset <= first && last <= e->offset + e->ins_len) {
+            // the last keystroke inserted what this one changes
+            SB amended = SB_create();
+            SB_push_back_many(&amended, &b->data.data[e->offset],
+                              first - e->offset);
+            SB_push_back_many(&amended, out.data, out.size);
+            SB_push_back_many(&amended, &b->data.data[last],
+                              e->offset + e->ins_len - last);
+            journal_amend(j, amended.data, amended.size);
+            SB_destroy(&amended);
+        } else {
+            journal_seal(j);
+            journal_record(j, first, out.data, out.size,
+                           &b->data.data[first], last - first);
+        }
+
+        // the swap has a record per cursor, not the whole span
+        buffer_splice(b, first, last - first, out.data, out.size);
+        j->sealed = false;
+    }
+    SB_destroy(&out);
+
+    // erasing brings cursors together, they stay one
+    u32 n = 0;
+    for (u32 i = 0; i < cursors->size; ++i) {
+        if (n > 0 && cursors->data[n - 1] == cursors->data[i]) continue;
+        cursors->data[n++] = cursors->data[i];
+    }
+    cursors->size = n;
+
+    b->cursor_main = u32s_find(cursors, main);
+    b->cursor = main;
+    update_last_visual_col(b);
+}
+
+static
+void begin_region(Buffer *b)
+{
+    b->region_begin = b->region_end = b->cursor;
+}
+
+static
+void end_region(Buffer *b)
+{
+    if (b->cursor < b->region_begin) {
+        b->region_end = b->region_begin;
+        b->region_begin = b->cursor;
+    } else if (b->cursor > b->region_begin) {
+        b->region_end = b->cursor;
+    } else {
+        discard_region(b);
+    }
+}
+
+static
+void discard_region(Buffer *b)
+{
+    b->region_begin = b->region_end = 0;
+}
+
+static
+void copy_region_append(Buffer *b)
+{
+    if (b->region_begin == b->region_end) return;
+    assert(b->region_end > b->region_begin);
+
+    clipboard_append(b->clipboard, b, b->region_begin,
+                     b->region_end - b->region_begin);
+}
+
+static
+void cut_region_append(Buffer *b)
+{
+    if (b->region_begin == b->region_end) return;
+    assert(b->region_end > b->region_begin);
+
+    clipboard_append(b->clipboard, b, b->region_begin,
                      b->region_end - b->region_begin);
+    buffer_delete(b, b->region_begin, b->region_end - b->region_begin);
+
+    b->cursor = b->region_begin;
+    update_last_visual_col(b);
+}
+
+static
+void delete_region(Buffer *b)
+{
+    if (b->region_begin == b->region_end) return;
+    assert(b->region_end > b->region_begin);
+
+    buffer_delete(b, b->region_begin, b->region_end - b->region_begin);
+
+    b->cursor = b->region_begin;
+    update_last_visual_col(b);
+}
+
+static
+void paste_clipboard_at_cursor(Buffer *b)
+{
+    u32 size = b->clipboard->size;
+    if (size == 0) return;
+
+    buffer_insert(b, b->cursor, clipboard_data(b->clipboard, b), size);
+
+    b->cursor += size;
+    update_last_visual_col(b);
+}
+
+static
+void clear_clipboard(Buffer *b)
+{
+    clipboard_clear(b->clipboard);
+}
+
+// Makes the buffer step places after the current one current. Buffers
+// keep their data, lines and viewport, so switching costs nothing unless
+// the budget released the caches of the one switched to.
+static
+void switch_buffer(s32 step)
+{
+    if (buffers.size < 2) return;
+
+    u32 i = 0;
+    while (buffers.data[i] != current_b) i++;
+
+    u32 next = (i + buffers.size + step % (s32)buffers.size) % buffers.size;
+    if (next == i) return;
+
+    swap_flush(&current_b->swap, false);
+    current_b->last_active_ns = time_ns();
+
+    current_b = buffers.data[next];
+    buffer_activate(current_b);
+    buffers_trim();
+}
+
+static
+void begin_search(Buffer *b, bool backward)
+{
+    count_cancel(&b->search.count); // its tasks read the query
+    if (b->search.query.data == NULL) b->search.query = SB_create();
+    b->search.query.size = 0;
+    b->search.origin = b->cursor;
+    b->search.backward = backward;
+    b->search.found = false;
+    b->mode = SEARCH_MODE;
+}
+
+static
+void compile_search(Search *s, DA_Arena *arena)
+{
+    count_cancel(&s->count);
+
+    if (s->compiled) {
+        re_cache_destroy(&s->cache);
+        re_destroy(&s->re);
+        s->compiled = false;
+    }
+    s->error = NULL;
+
+    if (!s->regex || s->query.size == 0) return;
+
+    s->error = re_compile(&s->re, s->query.data, s->query.size,
+                          &arena->alloc);
+    if (s->error) {
+        re_destroy(&s->re);
+        return;
+    }
+
+    re_cache_create(&s->cache, &s->re);
+    s->compiled = true;
+}
+
+// Incremental step: the query changed, search again from the origin.
+static
+void update_search(Buffer *b)
+{
+    compile_search(&b->search, b->arena);
+
+    u32 pos = search_from(b, b->search.origin, b->search.backward);
+
+    b->search.found = (pos != NOT_FOUND);
+    b->cursor = b->search.found ? pos : b->search.origin;
+
+    u32 cursor_row = update_last_visual_col(b);
+    if (cursor_row < b->row_offset ||
+        cursor_row >= b->row_offset + CONTENTS_HEIGHT) {
+        center_cursor_line(b);
+    }
+}
+
+static
+void end_search(Buffer *b, bool accept)
+{
+    if (!accept || !b->search.found) {
+        b->cursor = b->search.origin;
+        update_last_visual_col(b);
+    }
+    b->mode = NORMAL_MODE;
+
+    if (accept && !b->batch) count_start(&b->search, &b->data);
+}
+
+static
+void repeat_search(Buffer *b, bool backward)
+{
+    if (b->search.query.size == 0) return;
+    if (b->search.regex && !b->search.compiled) return;
+
+    b->search.origin = b->cursor;
+    b->search.backward = backward;
+
+    Count *count = &b->search.count;
+    if (!count->running && !count->done && !b->batch) {
+        count_start(&b->search, &b->data);
+    }
+
+    u32 pos = NOT_FOUND;
+    if (count->done && count->matches.size > 0) {
+        // the match list answers in O(log n)
+        u32 n = count->matches.size;
+        u32 i = count_find(count, b->cursor);
+
+        if (!backward) {
+            if (i < n && count->matches.data[i] == b->cursor) i++;
+            if (i == n) i = 0;
+        } else {
+            i = (i == 0) ? n - 1 : i - 1;
+        }
+        pos = count->matches.data[i];
+    } else if (!count->done) {
+        pos = search_from(b, b->search.origin, backward);
+    }
+    if (pos == NOT_FOUND) return;
+
+    b->cursor = pos;
+    u32 cursor_row = update_last_visual_col(b);
+    if (cursor_row < b->row_offset ||
+        cursor_row >= b->row_offset + CONTENTS_HEIGHT) {
+        center_cursor_line(b);
+    }
+}
+
+static
+void undo(Buffer *b)
+{
+    Journal *j = &b->journal;
+    if (j->pos == 0) return;
 
-    b->cursor = b->region_begin;
-    tokenize_lines(&b->lines, &b->data);
+    journal_seal(j);
+    Edit e = Edits_at(&j->edits, --j->pos);
+
+    buffer_apply(b, e.offset, e.ins_len,
+                 &j->arena.data[e.data + e.ins_len], e.del_len);
+
+    b->cursor = e.offset + e.del_len;
     update_last_visual_col(b);
-    b->saved = false;
 }
 
 static
-void paste_clipboard_at_cursor(Buffer *b)
+void redo(Buffer *b)
 {
-    if (b->clipboard.size == 0) return;
+    Journal *j = &b->journal;
+    if (j->pos == j->edits.size) return;
+
+    journal_seal(j);
+    Edit e = Edits_at(&j->edits, j->pos++);
 
-    SB_push_many(&b->data,
-                   b->cursor,
-                   b->clipboard.data,
-                   b->clipboard.size);
+    buffer_apply(b, e.offset, e.del_len, &j->arena.data[e.data], e.ins_len);
 
-    b->cursor += b->clipboard.size;
-    tokenize_lines(&b->lines, &b->data);
+    b->cursor = e.offset + e.ins_len;
     update_last_visual_col(b);
-    b->saved = false;
 }
 
+// Target of '%', '{' or '}' from the bracket index, NOT_FOUND stays.
 static
-void clear_clipboard(Buffer *b)
+void move_to_bracket(Buffer *b, u32 offset)
+{
+    if (offset == NOT_FOUND) return;
+
+    b->cursor = offset;
+    u32 cursor_row = update_last_visual_col(b);
+    if (cursor_row < b->row_offset ||
+        cursor_row >= b->row_offset + CONTENTS_HEIGHT) {
+        center_cursor_line(b);
+    }
+}
+
+// Jumps through the line index: a row is an index, an offset is found by
+// binary search, so the jump costs O(log n) whatever the file size.
+static
+void goto_target(Buffer *b, Goto g)
+{
+    if (g.unit == GOTO_LINE) {
+        u32 row = MIN(MAX(g.value, 1), b->lines.size) - 1;
+        b->cursor = Lines_at(&b->lines, row).begin;
+    } else if (g.unit == GOTO_BYTE) {
+        b->cursor = MIN(g.value, b->data.size);
+        while (b->cursor > 0 && b->cursor < b->data.size &&
+               UTF8_BYTESIZE(SB_at(&b->data, b->cursor)) == 0) {
+            b->cursor--;
+        }
+    } else {
+        u32 offset = b->data.size * g.value / 100;
+        u32 row = lines_find_row(&b->lines, offset);
+        b->cursor = Lines_at(&b->lines, row).begin;
+    }
+
+    update_last_visual_col(b);
+    center_cursor_line(b);
+}
+
+// Runs the command bound to c in the current mode. Returns false when the
+// editor should close.
+static
+bool handle_key(Buffer *b, char c)
+{
+    if (b->mode == NORMAL_MODE) {
+        switch (c) {
+        // basic commands
+        case 'q':
+            return false;
+        case 's':
+            buffer_save(b);
+            break;
+        case 'y':
+            paste_clipboard_at_cursor(b);
+            break;
+        case 'r':
+            clear_clipboard(b);
+            break;
+        case 'u':
+            undo(b);
+            break;
+        case 'U':
+            redo(b);
+            break;
+        case 'T':
+            if (!b->batch) profile.shown = !profile.shown; // pool threads
+            break;
+        case 'F':
+            if (b->follow.on) follow_stop(b);
+            else follow_start(b);
+            break;
+        case 'b':
+            if (!b->batch) switch_buffer(1);
+            break;
+        case ':':
+            SB_clear(&b->goto_input);
+            b->mode = GOTO_MODE;
+            break;
+        case 'B':
+            switch_buffer(-1);
+            break;
+
+        // search
+        case '/':
+            begin_search(b, false);
+            break;
+        case '?':
+            begin_search(b, true);
+            break;
+        case ']':
+            repeat_search(b, false);
+            break;
+        case '[':
+            repeat_search(b, true);
+            break;
+
+        // enterning insert mode
+        case 'i':
+            b->mode = INSERT_MODE;
+            break;
+        case 'A':
+            move_line_end(b);
+            b->mode = INSERT_MODE;
+            break;
+        case 'I':
+            move_line_begin(b);
+            b->mode = INSERT_MODE;
+            break;
+        case 'o':
+            move_line_end(b);
+            insert_char_at_cursor(b, '\n');
+            b->mode = INSERT_MODE;
+            break;
+        case 'O':
+            move_up(b);
+            move_line_end(b);
+            insert_char_at_cursor(b, '\n');
+            b->mode = INSERT_MODE;
+            break;
+
+        // entering region mode
+        case 'v':
+            b->mode = REGION_MODE;
+            begin_region(b);
+            break;
+
+        // movement
+        case 'j':
+            move_down(b);
+            break;
+        case 'k':
+            move_up(b);
+            break;
+        case 'l':
+            move_right(b);
+            break;
+        case 'h':
+            move_left(b);
+            break;
+        case 'n':
+            move_down_page(b);
+            center_cursor_line(b);
+            break;
+        case 'p':
+            move_up_page(b);
+            center_cursor_line(b);
+            break;
+        case '0':
+            move_line_first_char(b);
+            break;
+        case '^':
+            move_line_begin(b);
+            break;
+        case '$':
+            move_line_end(b);
+            break;
+        case 'g':
+            move_top(b);
+            break;
+        case 'G':
+            move_bottom(b);
+            break;
+        case '%':
+            move_to_bracket(b, brackets_match(b, b->cursor));
+            break;
+        case '}':
+            move_to_bracket(b, brackets_next_block(b, b->cursor));
+            break;
+        case '{':
+            move_to_bracket(b, brackets_prev_block(b, b->cursor));
+            break;
+
+        // screen operations
+        case 'f':
+            center_cursor_line(b);
+            break;
+
+        // TODO skip rendering on 'default'
+        }
+    } else if (b->mode == REGION_MODE) {
+        switch (c) {
+        // basic commands
+        case 'v':
+            discard_region(b);
+            b->mode = NORMAL_MODE;
+            break;
+        case 'c':
+            end_region(b);
+            copy_region_append(b);
+            b->mode = NORMAL_MODE;
+            break;
+        case 'x':
+            end_region(b);
+            cut_region_append(b);
+            b->mode = NORMAL_MODE;
+            break;
+        case 'd':
+            end_region(b);
+            delete_region(b);
+            b->mode = NORMAL_MODE;
+            break;
+        case 'm':
+            multi_cursor_start(b);
+            break;
+        case 'r':
+            clear_clipboard(b);
+            break;
+
+        // movement
+        case 'j':
+            move_down(b);
+            break;
+        case 'k':
+            move_up(b);
+            break;
+        case 'l':
+            move_right(b);
+            break;
+        case 'h':
+            move_left(b);
+            break;
+        case 'n':
+            move_down_page(b);
+            center_cursor_line(b);
+            break;
+        case 'p':
+            move_up_page(b);
+            center_cursor_line(b);
+            break;
+        case '0':
+            move_line_first_char(b);
+            break;
+        case '^':
+            move_line_begin(b);
+            break;
+        case '$':
+            move_line_end(b);
+            break;
+        case 'g':
+            move_top(b);
+            break;
+        case 'G':
+            move_bottom(b);
+            break;
+        case '%':
+            move_to_bracket(b, brackets_match(b, b->cursor));
+            break;
+        case '}':
+            move_to_bracket(b, brackets_next_block(b, b->cursor));
+            break;
+        case '{':
+            move_to_bracket(b, brackets_prev_block(b, b->cursor));
+            break;
+
+        // screen operations
+        case 'f':
+            center_cursor_line(b);
+            break;
+        }
+    } else if (b->mode == INSERT_MODE) {
+        switch (c) {
+        case 033:
+            journal_seal(&b->journal);
+            multi_cursor_stop(b);
+            b->mode = NORMAL_MODE;
+            break;
+        case 127: // backspace
+            backspace(b);
+            break;
+        case '\t':
+            insert_indent_spaces_at_cursor(b);
+            break;
+        default:
+            insert_char_at_cursor(b, c);
+        }
+    } else if (b->mode == SEARCH_MODE) {
+        switch (c) {
+        case 033:
+            end_search(b, false);
+            break;
+        case '\r':
+        case '\n':
+            end_search(b, true);
+            break;
+        case 127: // backspace
+            while (b->search.query.size > 0 &&
+                   UTF8_BYTESIZE(SB_pop_back(&b->search.query)) == 0);
+            update_search(b);
+            break;
+        case 022: // ctrl-r
+            b->search.regex = !b->search.regex;
+            update_search(b);
+            break;
+        default:
+            if (b->search.query.size + 1 < TEMP_BUF_SIZE / 2) {
+                SB_push_back(&b->search.query, c);
+                update_search(b);
+            }
+        }
+    } else if (b->mode == GOTO_MODE) {
+        Goto g;
+        switch (c) {
+        case 033:
+            b->mode = NORMAL_MODE;
+            break;
+        case '\r':
+        case '\n':
+            if (goto_parse(&b->goto_input, &g)) goto_target(b, g);
+            b->mode = NORMAL_MODE;
+            break;
+        case 127: // backspace
+            if (b->goto_input.size > 0) SB_pop_back(&b->goto_input);
+            break;
+        default:
+            if (b->goto_input.size + 1 < TEMP_BUF_SIZE / 2) {
+                SB_push_back(&b->goto_input, c);
+            }
+        }
+    }
+
+    return true;
+}
+
+// The pager when there is one, else the current buffer.
+static
+bool handle_key_current(char c)
+{
+    if (current_p) return pager_handle_key(current_p, c);
+    return handle_key(current_b, c);
+}
+
+static
+void render_current(void)
+{
+    if (current_p) {
+        pager_render(current_p);
+        return;
+    }
+    count_poll(&current_b->search.count);
+    render(current_b);
+}
+
+// #########################################################################
+// Pager functions
+// #########################################################################
+
+static
+bool pager_open(Pager *p, const char *path)
+{
+    memset(p, 0, sizeof(Pager));
+
+    p->fd = open(path, O_RDONLY);
+    if (p->fd < 0) return false;
+
+    struct stat st;
+    if (fstat(p->fd, &st) != 0) {
+        close(p->fd);
+        return false;
+    }
+    p->size = st.st_size;
+
+    p->path = SB_create();
+    SB_push_back_many(&p->path, path, strlen(path));
+
+    p->checkpoints = U64s_create();
+    U64s_push_back(&p->checkpoints, 0);
+    p->disk = st;
+
+    Index x;
+    if (index_open(&x, path, &st, PAGER_CHECKPOINT)) {
+        u64 start;
+        bool flag;
+        bool ok = index_next(&x, &start, &flag) && start == 0;
+        for (u64 i = 1; ok && i < x.header.count; ++i) {
+            u64 last = p->checkpoints.data[p->checkpoints.size - 1];
+            ok = index_next(&x, &start, &flag) && start > last;
+            if (ok) U64s_push_back(&p->checkpoints, start);
+        }
+        if (!ok) p->checkpoints.size = 1;
+        index_close(&x);
+    }
+    p->indexed = p->checkpoints.size;
+
+    return true;
+}
+
+// Keeps the checkpoints for the next -R of the same file if this one
+// counted rows past what the index file had.
+static
+void pager_store_index(Pager *p)
+{
+    if (p->checkpoints.size <= p->indexed || p->size < INDEX_MIN_SIZE) return;
+
+    char path[TEMP_BUF_SIZE] = {0};
+    strncpy(path, p->path.data, MIN(p->path.size, TEMP_BUF_SIZE - 1));
+
+    SB varints = SB_create();
+    u64 prev = 0;
+    for (u32 i = 0; i < p->checkpoints.size; ++i) {
+        index_put(&varints, p->checkpoints.data[i] - prev, false);
+        prev = p->checkpoints.data[i];
+    }
+
+    index_write(path, &p->disk, PAGER_CHECKPOINT, p->checkpoints.size,
+                &varints);
+    p->indexed = p->checkpoints.size;
+    SB_destroy(&varints);
+}
+
+static
+void pager_close(Pager *p)
+{
+    pager_store_index(p);
+
+    for (u32 i = 0; i < PAGER_WINDOWS; ++i) {
+        Pager_Window *w = &p->windows[i];
+        if (w->data) munmap((void *)w->data, w->size);
+    }
+    close(p->fd);
+    SB_destroy(&p->path);
+    SB_destroy(&p->goto_input);
+    U64s_destroy(&p->checkpoints);
+    memset(p, 0, sizeof(Pager));
+}
+
+// The file can be truncated while it is viewed (logrotate copytruncate),
+// and touching a mapping past its new end raises SIGBUS. Shrinks to the
+// size on disk and drops the windows and checkpoints beyond it.
+static
+void pager_clamp(Pager *p)
+{
+    struct stat st;
+    if (fstat(p->fd, &st) < 0 || (u64)st.st_size >= p->size) return;
+    p->size = st.st_size;
+
+    for (u32 i = 0; i < PAGER_WINDOWS; ++i) {
+        Pager_Window *w = &p->windows[i];
+        if (!w->data || w->begin + w->size <= p->size) continue;
+        munmap((void *)w->data, w->size);
+        w->data = NULL;
+    }
+
+    while (p->checkpoints.size > 1 &&
+           p->checkpoints.data[p->checkpoints.size - 1] > p->size) {
+        p->checkpoints.size--;
+    }
+    p->indexed = MIN(p->indexed, p->checkpoints.size);
+
+    if (p->top > p->size) {
+        p->top = pager_line_begin(p, p->size);
+        p->top_row = p->top == 0 ? 0 : PAGER_UNKNOWN;
+    }
+}
+
+// Points data at offset and returns how many bytes from there are mapped
+// contiguously, 0 at the end of the file or if it can't be mapped. The
+// least recently used window is unmapped to make room, so at most
+// PAGER_WINDOWS are resident.
+static
+u64 pager_span(Pager *p, u64 offset, const char **data)
+{
+    if (offset >= p->size) return 0;
+
+    u64 begin = offset / PAGER_WINDOW_SIZE * PAGER_WINDOW_SIZE;
+    Pager_Window *w = &p->windows[0];
+
+    for (u32 i = 0; i < PAGER_WINDOWS; ++i) {
+        Pager_Window *it = &p->windows[i];
+        if (it->data && it->begin == begin) {
+            w = it;
+            goto found;
+        }
+        if (!it->data || (w->data && it->last_used < w->last_used)) w = it;
+    }
+
+    if (w->data) munmap((void *)w->data, w->size);
+    w->data = NULL;
+
+    pager_clamp(p);
+    if (offset >= p->size) return 0;
+
+    w->begin = begin;
+    w->size = MIN(PAGER_WINDOW_SIZE, p->size - begin);
+    const char *mapped = mmap(NULL, w->size, PROT_READ, MAP_PRIVATE,
+                              p->fd, begin);
+    if (mapped == MAP_FAILED) return 0;
+    w->data = mapped;
+
+found:
+    w->last_used = ++p->clock;
+    *data = &w->data[offset - begin];
+    return w->size - (offset - begin);
+}
+
+// Offset of the '\n' ending the line that begins at begin, or the size.
+static
+u64 pager_line_end(Pager *p, u64 begin)
+{
+    const char *data;
+    u64 n;
+
+    while ((n = pager_span(p, begin, &data)) > 0) {
+        const char *nl = memchr(data, '\n', n);
+        if (nl) return begin + (nl - data);
+        begin += n;
+    }
+    return p->size;
+}
+
+// Beginning of the line containing offset.
+static
+u64 pager_line_begin(Pager *p, u64 offset)
+{
+    while (offset > 0) {
+        u64 begin = (offset - 1) / PAGER_WINDOW_SIZE * PAGER_WINDOW_SIZE;
+        const char *data;
+        u64 n = pager_span(p, begin, &data);
+        if (n == 0) return MIN(offset, p->size);
+
+        for (u64 i = MIN(offset - begin, n); i > 0; --i) {
+            if (data[i - 1] == '\n') return begin + i;
+        }
+        offset = begin;
+    }
+    return 0;
+}
+
+// Scrolls n lines down, at most until the last line is on top. Rows
+// counted on the way extend the line index.
+static
+void pager_down(Pager *p, u64 n)
+{
+    for (u64 i = 0; i < n; ++i) {
+        u64 end = pager_line_end(p, p->top);
+        if (end >= p->size) return;
+        p->top = end + 1;
+
+        if (p->top_row == PAGER_UNKNOWN) continue;
+        p->top_row++;
+        if (p->top_row == p->checkpoints.size * PAGER_CHECKPOINT) {
+            U64s_push_back(&p->checkpoints, p->top);
+        }
+    }
+}
+
+static
+void pager_up(Pager *p, u64 n)
+{
+    for (u64 i = 0; i < n && p->top > 0; ++i) {
+        p->top = pager_line_begin(p, p->top - 1);
+        if (p->top_row != PAGER_UNKNOWN) p->top_row--;
+    }
+    if (p->top == 0) p->top_row = 0;
+}
+
+// Shows the last screen of the file, found by scanning back from its end.
+// The row stays unknown unless the line index already reaches there.
+static
+void pager_bottom(Pager *p)
+{
+    p->top = pager_line_begin(p, p->size);
+    p->top_row = PAGER_UNKNOWN;
+    pager_up(p, CONTENTS_HEIGHT - 1);
+}
+
+// Bytes and percentages are found by scanning back to a line start.
+// Lines start at the closest indexed row before them, so only rows past
+// the end of the line index are counted on the way.
+static
+void pager_goto(Pager *p, Goto g)
+{
+    if (g.unit == GOTO_LINE) {
+        u64 row = MAX(g.value, 1) - 1;
+        u64 i = MIN(row / PAGER_CHECKPOINT, p->checkpoints.size - 1);
+        p->top = p->checkpoints.data[i];
+        p->top_row = i * PAGER_CHECKPOINT;
+        pager_down(p, row - p->top_row);
+        return;
+    }
+
+    u64 offset = MIN(g.value, p->size);
+    if (g.unit == GOTO_PERCENT) offset = p->size / 100 * g.value +
+                                         p->size % 100 * g.value / 100;
+
+    p->top = pager_line_begin(p, offset);
+    p->top_row = PAGER_UNKNOWN;
+    if (p->top == 0) p->top_row = 0;
+}
+
+static
+void pager_render(Pager *p)
+{
+    pager_clamp(p);
+
+    u64 t = time_ns();
+    term_clear();
+
+    Utf8_Char c = {0};
+    u64 begin = p->top;
+
+    for (u32 row_i = 0; row_i + 1 < term_height; ++row_i) {
+        if (begin > p->size || (begin == p->size && row_i > 0)) {
+            c.abs = 0;
+            c.arr[0] = '~';
+            TERM_SET_CELL(c, 0, row_i, 0);
+            continue;
+        }
+
+        // only what fits on screen is copied out, the window may end in it
+        char line[MAX_WIDTH * 4];
+        u32 n = 0;
+        const char *data;
+        u64 got;
+        while (n < sizeof(line) &&
+               (got = pager_span(p, begin + n, &data)) > 0) {
+            u32 k = MIN(got, sizeof(line) - n);
+            const char *nl = memchr(data, '\n', k);
+            if (nl) k = nl - data;
+            memcpy(&line[n], data, k);
+            n += k;
+            if (nl) break;
+        }
+
+        u16 col_i = 0;
+        for (u32 i = 0; i < n && col_i < CONTENTS_WIDTH; ++col_i) {
+            u8 size = (u8)line[i] > 247 ? 0 : UTF8_BYTESIZE(line[i]);
+
+            c.abs = 0;
+            if (size == 0 || i + size > n) {
+                c.arr[0] = '?'; // not UTF-8, any file can be viewed
+                size = 1;
+            } else {
+                memcpy(c.arr, &line[i], size);
+            }
+            TERM_SET_CELL(c, 0, row_i, col_i);
+            i += size;
+        }
+
+        begin = pager_line_end(p, begin) + 1;
+    }
+
+    SB status = SB_create_with(&frame_arena.alloc);
+
+    if (profile.shown) {
+        profile_status(&status);
+    } else if (p->going_to) {
+        SB_push_back(&status, ':');
+        SB_push_back_many(&status, p->goto_input.data, p->goto_input.size);
+    } else {
+        SB_push_back_many(&status, p->path.data, p->path.size);
+        if (p->top_row == PAGER_UNKNOWN) {
+            sb_appendf(&status, ":?");
+        } else {
+            sb_appendf(&status, ":%lu", p->top_row + 1);
+        }
+        sb_appendf(&status, " [read-only] [%lu%%]",
+                   p->size ? p->top * 100 / p->size : 100);
+    }
+
+    u16 col_i = 0;
+    for (u32 i = 0; i < status.size && col_i < term_width;) {
+        u8 size = UTF8_BYTESIZE(status.data[i]);
+
+        c.abs = 0;
+        memcpy(c.arr, &status.data[i], size);
+
+        TERM_SET_CELL(c, 0, term_height - 1, col_i);
+        i += size;
+        col_i++;
+    }
+
+    profile_add(PHASE_RENDER, t);
+
+    t = time_ns();
+    sb_appendf(&term_out, "\033[?25l"); // hide cursor
+    term_display();
+    sb_appendf(&term_out, "\033[?25h"); // show cursor
+
+    TERM_MOVE_CURSOR(1, 1);
+    profile_add(PHASE_DISPLAY, t);
+
+    term_flush();
+}
+
+static
+bool pager_handle_key(Pager *p, char c)
+{
+    pager_clamp(p);
+
+    if (p->going_to) {
+        Goto g;
+        if (c == '\r' || c == '\n') {
+            if (goto_parse(&p->goto_input, &g)) pager_goto(p, g);
+            p->going_to = false;
+        } else if (c == 033) {
+            p->going_to = false;
+        } else if (c == 127) {
+            if (p->goto_input.size > 0) SB_pop_back(&p->goto_input);
+        } else if (p->goto_input.size + 1 < TEMP_BUF_SIZE / 2) {
+            SB_push_back(&p->goto_input, c);
+        }
+        return true;
+    }
+
+    switch (c) {
+    case 'q':
+        return false;
+    case 'T':
+        profile.shown = !profile.shown;
+        break;
+    case 'j':
+        pager_down(p, 1);
+        break;
+    case 'k':
+        pager_up(p, 1);
+        break;
+    case 'n':
+        pager_down(p, CONTENTS_HEIGHT / 2);
+        break;
+    case 'p':
+        pager_up(p, CONTENTS_HEIGHT / 2);
+        break;
+    case 'g':
+        p->top = 0;
+        p->top_row = 0;
+        break;
+    case 'G':
+        pager_bottom(p);
+        break;
+    case ':':
+        SB_clear(&p->goto_input);
+        p->going_to = true;
+        break;
+    }
+    return true;
+}
+
+// #########################################################################
+// Bench functions
+// #########################################################################
+
+static
+int compare_u32(const void *a, const void *b)
+{
+    u32 x = *(const u32 *)a;
+    u32 y = *(const u32 *)b;
+    return (x > y) - (x < y);
+}
+
+static
+double percentile_us(const U32s *sorted, u32 p)
+{
+    if (sorted->size == 0) return 0;
+    return sorted->data[(sorted->size - 1) * p / 1000] / 1000.0;
+}
+
+// Replays the keys file through handle_key like the main loop does, with
+// the terminal kept in memory. A key's latency covers dispatch and render.
+static
+void bench_replay(const char *keys_path, u64 load_ns)
 {
-    SB_clear(&b->clipboard);
+    FILE *fp = fopen(keys_path, "r");
+    if (fp == NULL) {
+        printf("no keys file found\n");
+        return;
+    }
+
+    SB keys = SB_create();
+    char tmp[TEMP_BUF_SIZE];
+    size_t n;
+    while ((n = fread(tmp, 1, TEMP_BUF_SIZE, fp)) > 0) {
+        SB_push_back_many(&keys, tmp, n);
+    }
+    fclose(fp);
+
+    term_width = BENCH_WIDTH;
+    term_height = BENCH_HEIGHT;
+
+    da_arena_reset(&frame_arena);
+    u64 first_frame_ns = time_ns();
+    render_current();
+    profile_commit();
+    first_frame_ns = time_ns() - first_frame_ns;
+    u64 first_frame_bytes = term_bytes;
+
+    U32s latencies = U32s_create();
+    u64 total_ns = 0;
+    u64 max_frame_bytes = 0;
+
+    for (u32 i = 0; i < keys.size; ++i) {
+        u64 t = time_ns();
+        u64 bytes = term_bytes;
+
+        da_arena_reset(&frame_arena);
+        u64 dispatch_t = time_ns();
+        bool keep_running = handle_key_current(keys.data[i]);
+        profile_add(PHASE_DISPATCH, dispatch_t);
+        if (keep_running) render_current();
+        profile_commit();
+
+        t = time_ns() - t;
+        total_ns += t;
+        U32s_push_back(&latencies, MIN(t, NOT_FOUND));
+        max_frame_bytes = MAX(max_frame_bytes, term_bytes - bytes);
+
+        if (!keep_running) break;
+    }
+
+    qsort(latencies.data, latencies.size, sizeof(u32), compare_u32);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    u32 keys_done = latencies.size;
+    u64 key_bytes = term_bytes - first_frame_bytes;
+
+    if (current_p) {
+        Pager *p = current_p;
+        printf("file      %.*s, %lu bytes, read-only, %lu index entries, "
+               "opened in %.1f ms\n",
+               (s32)p->path.size, p->path.data, p->size,
+               p->checkpoints.size, load_ns / 1e6);
+    } else {
+        Buffer *b = buffers.data[0];
+        printf("file      %.*s, %lu bytes, %lu lines, loaded in %.1f ms\n",
+               (s32)b->path.size, b->path.data, b->data.size, b->lines.size,
+               load_ns / 1e6);
+    }
+    printf("frame     first in %.1f ms, %lu bytes\n",
+           first_frame_ns / 1e6, first_frame_bytes);
+    printf("keys      %u in %.1f ms, %ux%u terminal\n",
+           keys_done, total_ns / 1e6, term_width, term_height);
+    printf("latency   p50 %.1f us, p90 %.1f us, p99 %.1f us, "
+           "p99.9 %.1f us, max %.1f us\n",
+           percentile_us(&latencies, 500), percentile_us(&latencies, 900),
+           percentile_us(&latencies, 990), percentile_us(&latencies, 999),
+           percentile_us(&latencies, 1000));
+    printf("emitted   %lu bytes, %.1f per key, at most %lu in a frame\n",
+           key_bytes, keys_done ? (double)key_bytes / keys_done : 0.0,
+           max_frame_bytes);
+    printf("peak rss  %ld KB\n", usage.ru_maxrss);
+
+    U32s_destroy(&latencies);
+    SB_destroy(&keys);
+}
+
+// #########################################################################
+// Batch functions
+// #########################################################################
+
+// Reads a command argument up to delim (or the end of the line), with \e
+// \r \n \t \\ \xNN and an escaped delim. Other escapes are kept for
+// the regex. Returns where it stopped.
+static
+const char *batch_unescape(const char *s, char delim, SB *out)
+{
+    while (*s && *s != '\n' && *s != delim) {
+        char c = *s++;
+        if (c == '\\' && *s) {
+            c = *s++;
+            if      (c == 'e') c = 033;
+            else if (c == 'r') c = '\r';
+            else if (c == 'n') c = '\n';
+            else if (c == 't') c = '\t';
+            else if (c == 'x' && s[0] && s[1]) {
+                char hex[3] = { s[0], s[1], 0 };
+                c = (char)strtol(hex, NULL, 16);
+                s += 2;
+            } else if (c != '\\' && c != delim) {
+                SB_push_back(out, '\\'); // left to the regex
+            }
+        }
+        SB_push_back(out, c);
+    }
+    return s;
+}
+
+// Lines are "keys text", "r/from/to/" or "s/from/to/", any byte after r
+// and s is the delimiter. Empty lines and lines starting with '#' are
+// skipped.
+static
+bool batch_parse(const char *script_path, Batch_Commands *script)
+{
+    FILE *fp = fopen(script_path, "r");
+    if (fp == NULL) {
+        printf("no script found\n");
+        return false;
+    }
+
+    char line[TEMP_BUF_SIZE];
+    for (u32 line_i = 1; fgets(line, TEMP_BUF_SIZE, fp); ++line_i) {
+        if (line[0] == '\n' || line[0] == '#' || line[0] == '\0') continue;
+
+        Batch_Command cmd = { .arg = SB_create(), .with = SB_create() };
+        const char *s = line;
+
+        if (strncmp(s, "keys ", 5) == 0) {
+            cmd.op = BATCH_KEYS;
+            batch_unescape(s + 5, '\n', &cmd.arg);
+        } else if ((s[0] == 'r' || s[0] == 's') && s[1] && s[1] != '\n') {
+            cmd.op = s[0] == 'r' ? BATCH_REPLACE : BATCH_REPLACE_REGEX;
+            char delim = s[1];
+            s = batch_unescape(s + 2, delim, &cmd.arg);
+            if (*s == delim) s = batch_unescape(s + 1, delim, &cmd.with);
+            if (*s != delim || cmd.arg.size == 0) goto bad;
+        } else {
+            goto bad;
+        }
+
+        Batch_Commands_push_back(script, cmd);
+        continue;
+
+    bad:
+        printf("%s:%u: expected keys, r/from/to/ or s/from/to/\n",
+               script_path, line_i);
+        SB_destroy(&cmd.arg);
+        SB_destroy(&cmd.with);
+        fclose(fp);
+        return false;
+    }
+
+    fclose(fp);
+    return true;
+}
+
+// Runs the script on one file with a buffer and arena of its own and
+// saves the file if it changed. A 'q' key ends the script for the file.
+static
+void batch_run_file(void *arg)
+{
+    Batch_Job *job = arg;
+
+    Buffer *b = malloc(sizeof(Buffer));
+    assert(b && "Buy more RAM");
+
+    if (buffer_create_from_file(b, job->path) == 0) {
+        free(b);
+        return;
+    }
+
+    Clipboard clip = {0};
+    DA_Arena arena = {0};
+    da_arena_init(&arena, FRAME_ARENA_SIZE);
+
+    b->clipboard = &clip;
+    b->arena = &arena;
+    b->batch = true;
+    job->bytes = b->data.size;
+    job->ok = true;
+
+    const Batch_Commands *script = job->script;
+    for (u32 i = 0; i < script->size; ++i) {
+        const Batch_Command *cmd = &script->data[i];
+        da_arena_reset(&arena);
+
+        if (cmd->op == BATCH_KEYS) {
+            bool keep_running = true;
+            for (u32 k = 0; k < cmd->arg.size && keep_running; ++k) {
+                keep_running = handle_key(b, cmd->arg.data[k]);
+            }
+            if (!keep_running) break;
+        } else {
+            u32 n = replace_all(b, cmd->arg.data, cmd->arg.size,
+                                cmd->op == BATCH_REPLACE_REGEX,
+                                cmd->with.data, cmd->with.size);
+            if (n == NOT_FOUND) {
+                job->ok = false;
+                break;
+            }
+            job->matches += n;
+        }
+    }
+
+    if (job->ok && !b->saved) buffer_save(b);
+
+    buffer_kill(b);
+    free(b);
+    clipboard_destroy(&clip);
+    da_arena_destroy(&arena);
+}
+
+// Edits every file on the pool, one task per file, and reports the
+// throughput. Returns false if a file couldn't be edited.
+static
+bool batch_run(const char *script_path, const char **paths, u32 paths_count)
+{
+    Batch_Commands script = Batch_Commands_create();
+    if (!batch_parse(script_path, &script)) {
+        Batch_Commands_destroy(&script);
+        return false;
+    }
+
+    Batch_Job *jobs = calloc(paths_count, sizeof(Batch_Job));
+    assert(jobs && "Buy more RAM");
+
+    u64 t = time_ns();
+    pool_create(&pool, sysconf(_SC_NPROCESSORS_ONLN));
+    for (u32 i = 0; i < paths_count; ++i) {
+        jobs[i].path = paths[i];
+        jobs[i].script = &script;
+        pool_submit(&pool, batch_run_file, &jobs[i]);
+    }
+    pool_wait(&pool);
+    t = time_ns() - t;
+
+    u64 bytes = 0;
+    u64 matches = 0;
+    u32 failed = 0;
+    for (u32 i = 0; i < paths_count; ++i) {
+        bytes += jobs[i].bytes;
+        matches += jobs[i].matches;
+        if (!jobs[i].ok) {
+            printf("failed    %s\n", jobs[i].path);
+            failed++;
+        }
+    }
+
+    double s = MAX(t, 1) / 1e9;
+    printf("files     %u in %.1f ms on %u threads, %u failed\n",
+           paths_count, t / 1e6, pool.thread_count, failed);
+    printf("speed     %.1f files/s, %.1f MB/s\n",
+           paths_count / s, bytes / s / (1024 * 1024));
+    printf("replaced  %lu matches\n", matches);
+
+    for (u32 i = 0; i < script.size; ++i) {
+        SB_destroy(&script.data[i].arg);
+        SB_destroy(&script.data[i].with);
+    }
+    Batch_Commands_destroy(&script);
+    free(jobs);
+    return failed == 0;
 }